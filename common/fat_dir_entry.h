@@ -0,0 +1,55 @@
+#ifndef COMMON_FAT_DIR_ENTRY_H
+#define COMMON_FAT_DIR_ENTRY_H
+
+// Decodes the raw 32-byte entries that a FAT directory is made of.
+// Reading these straight out of the directory is a lot faster than
+// opening every file to find out its name and size.
+class FatDirEntry {
+public:
+  enum {
+    kSize = 32,
+    ATTR_VOLUME_ID = 0x08,
+    ATTR_DIRECTORY = 0x10,
+    ATTR_LONG_NAME = 0x0F,
+  };
+
+  enum Type {
+    END,      // No more entries in this directory.
+    SKIP,     // Deleted, "." / "..", volume label or long name part.
+    ENTRY,
+  };
+
+  Type Parse(const uint8_t* e) {
+    if (e[0] == 0) return END;
+    if (e[0] == 0xE5 || e[0] == '.') return SKIP;
+    attributes_ = e[11];
+    if ((attributes_ & ATTR_LONG_NAME) == ATTR_LONG_NAME) return SKIP;
+    if (attributes_ & ATTR_VOLUME_ID) return SKIP;
+    char* p = name_;
+    for (int i = 0; i < 8 && e[i] != ' '; i++) *p++ = e[i];
+    // 0x05 stands for 0xE5, which otherwise means deleted.
+    if (name_[0] == 0x05) name_[0] = 0xE5;
+    if (e[8] != ' ') {
+      *p++ = '.';
+      for (int i = 8; i < 11 && e[i] != ' '; i++) *p++ = e[i];
+    }
+    *p = 0;
+    cluster_ = e[26] | (e[27] << 8) | (e[20] << 16) | ((uint32_t)e[21] << 24);
+    size_ = e[28] | (e[29] << 8) | (e[30] << 16) | ((uint32_t)e[31] << 24);
+    return ENTRY;
+  }
+
+  const char* name() const { return name_; }
+  uint32_t size() const { return size_; }
+  uint8_t attributes() const { return attributes_; }
+  uint32_t cluster() const { return cluster_; }
+  bool isdir() const { return attributes_ & ATTR_DIRECTORY; }
+
+private:
+  char name_[13];
+  uint8_t attributes_;
+  uint32_t cluster_;
+  uint32_t size_;
+};
+
+#endif
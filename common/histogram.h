@@ -0,0 +1,64 @@
+#ifndef COMMON_HISTOGRAM_H
+#define COMMON_HISTOGRAM_H
+
+// Histogram with power-of-two buckets. Bucket 0 counts 0 and 1,
+// bucket N counts values from 2^N up to 2^(N+1)-1.
+// Cheap enough to update from interrupts.
+class Log2Histogram {
+public:
+  Log2Histogram() { Clear(); }
+  void Add(uint32_t value) {
+    buckets_[31 - __builtin_clz(value | 1)]++;
+    if (value > max_) max_ = value;
+    count_++;
+  }
+  void Clear() {
+    for (size_t i = 0; i < NELEM(buckets_); i++) buckets_[i] = 0;
+    max_ = 0;
+    count_ = 0;
+  }
+  uint32_t bucket(int i) const { return buckets_[i]; }
+  uint32_t max() const { return max_; }
+  uint32_t count() const { return count_; }
+
+  // Prints the non-empty buckets, one per line.
+  void Print(const char* unit) const {
+    for (size_t i = 0; i < NELEM(buckets_); i++) {
+      if (!buckets_[i]) continue;
+      if (i == NELEM(buckets_) - 1) {
+        // 2 << 31 doesn't fit in 32 bits.
+        STDOUT.print("  >= 2^31 ");
+      } else {
+        STDOUT.print("  < ");
+        STDOUT.print(2u << i);
+        STDOUT.print(" ");
+      }
+      STDOUT.print(unit);
+      STDOUT.print(": ");
+      STDOUT.println(buckets_[i]);
+    }
+    STDOUT.print("  max: ");
+    STDOUT.println(max_);
+  }
+
+  // Prints NAME=b0,b1,...,b31 and NAME_MAX=max
+  void PrintMachine(const char* name) const {
+    STDOUT.print(name);
+    STDOUT.print("=");
+    for (size_t i = 0; i < NELEM(buckets_); i++) {
+      if (i) STDOUT.print(",");
+      STDOUT.print(buckets_[i]);
+    }
+    STDOUT.println("");
+    STDOUT.print(name);
+    STDOUT.print("_MAX=");
+    STDOUT.println(max_);
+  }
+
+private:
+  volatile uint32_t buckets_[32];
+  volatile uint32_t max_;
+  volatile uint32_t count_;
+};
+
+#endif
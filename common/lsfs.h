@@ -2,10 +2,13 @@
 #define COMMON_LSFS_H
 
 // Filesystem abstractions
+// LSFS::Iterator lists a directory without opening the files in it.
+// On STM32, DOSFS f_findfirst/f_findnext already work that way.
 
 #ifdef TEENSYDUINO
 
 #include <SD.h>
+#include "fat_dir_entry.h"
 
 class LSFS {
 public:
@@ -27,35 +30,57 @@ public:
   static File OpenForWrite(const char* path) {
     return SD.open(path, FILE_WRITE);
   }
+  static bool Remove(const char* path) {
+    return SD.remove(path);
+  }
+  // Reads the raw directory entries instead of using openNextFile(),
+  // which opens every file just to get its name. Names are 8.3, same
+  // as everywhere else in the SD library.
   class Iterator {
   public:
     explicit Iterator(const char* dirname) {
-      dir_ = SD.open(dirname);
-      if (dir_.isDirectory()) {
-        f_ = dir_.openNextFile();
-      }
+      strcpy(path_, dirname);
+      Open();
     }
     explicit Iterator(Iterator& other) {
-      dir_ = other.f_;
-      other.f_ = File();
-      f_ = dir_.openNextFile();
+      strcpy(path_, other.path_);
+      if (*path_ && path_[strlen(path_) - 1] != '/') strcat(path_, "/");
+      strcat(path_, other.name());
+      Open();
     }
     ~Iterator() {
       dir_.close();
-      f_.close();
     }
     void operator++() {
-      f_.close();
-      f_ = dir_.openNextFile();
+      uint8_t raw[FatDirEntry::kSize];
+      while (dir_.read(raw, sizeof(raw)) == sizeof(raw)) {
+        FatDirEntry::Type type = entry_.Parse(raw);
+        if (type == FatDirEntry::ENTRY) return;
+        if (type == FatDirEntry::END) break;
+      }
+      dir_.close();
     }
-    operator bool() { return f_; }
-    bool isdir() { return f_.isDirectory(); }
-    const char* name() { return f_.name(); }
-    size_t size() { return f_.size(); }
+    operator bool() { return dir_; }
+    bool isdir() { return entry_.isdir(); }
+    const char* name() { return entry_.name(); }
+    size_t size() { return entry_.size(); }
+    uint8_t attributes() { return entry_.attributes(); }
+    uint32_t cluster() { return entry_.cluster(); }
     
   private:
+    void Open() {
+      dir_ = SD.open(path_);
+      if (!dir_) return;
+      if (!dir_.isDirectory()) {
+        dir_.close();
+        return;
+      }
+      ++*this;
+    }
+
+    char path_[128];
     File dir_;
-    File f_;
+    FatDirEntry entry_;
   };
 };
 #else
@@ -77,6 +102,9 @@ public:
   static File OpenForWrite(const char* path) {
     return DOSFS.open(path, "wc");
   }
+  static bool Remove(const char* path) {
+    return DOSFS.remove(path);
+  }
   class Iterator {
   public:
     explicit Iterator(const char* path) {
@@ -120,6 +148,8 @@ public:
     bool isdir() { return _find.attr & F_ATTR_DIR; }
     const char* name() { return _find.filename; }
     size_t size() { return _find.filesize; }
+    uint8_t attributes() { return _find.attr; }
+    uint32_t cluster() { return _find.cluster; }
     
   private:
     char _path[F_MAXPATH];
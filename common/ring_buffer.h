@@ -0,0 +1,91 @@
+#ifndef COMMON_RING_BUFFER_H
+#define COMMON_RING_BUFFER_H
+
+// Lock-free single-producer, single-consumer ring buffer.
+// One context (thread or interrupt) may write while another one
+// reads, without any locking. Only the producer modifies end_ and
+// only the consumer modifies begin_. Each side publishes its index
+// with a release store and reads the other side's index with an
+// acquire load, so the data is always visible before the index.
+// The indices are free-running and wrap around naturally, which is
+// why N needs to be a power of two.
+template<class T, size_t N>
+class RingBuffer {
+public:
+  static_assert(N && (N & (N - 1)) == 0, "N must be a power of two");
+
+  // Number of elements that can be read.
+  size_t size() const { return load(end_) - load(begin_); }
+  // Number of elements that can be written.
+  size_t space() const { return N - size(); }
+  bool empty() const { return size() == 0; }
+  static size_t capacity() { return N; }
+
+  // Producer side.
+
+  // Points |*data| at free space and returns how many elements
+  // can be written there contiguously. Call push() when done.
+  size_t write_span(T** data) {
+    size_t end = end_;
+    size_t pos = end & (N - 1);
+    *data = buffer_ + pos;
+    return min(N - (end - load(begin_)), N - pos);
+  }
+  // Publishes |n| elements written through write_span().
+  void push(size_t n) { store(end_, end_ + n); }
+  // Copies up to |n| elements into the buffer, returns how many.
+  size_t write(const T* data, size_t n) {
+    size_t done = 0;
+    while (done < n) {
+      T* dest;
+      size_t to_copy = min(write_span(&dest), n - done);
+      if (!to_copy) break;
+      memcpy(dest, data + done, to_copy * sizeof(T));
+      push(to_copy);
+      done += to_copy;
+    }
+    return done;
+  }
+
+  // Consumer side.
+
+  // Points |*data| at the next elements to read and returns how
+  // many are contiguous. They stay valid until pop() is called.
+  size_t read_span(const T** data) const {
+    size_t begin = begin_;
+    size_t pos = begin & (N - 1);
+    *data = buffer_ + pos;
+    return min(load(end_) - begin, N - pos);
+  }
+  // Releases |n| elements returned by read_span().
+  void pop(size_t n) { store(begin_, begin_ + n); }
+  // Copies up to |n| elements out of the buffer, returns how many.
+  size_t read(T* data, size_t n) {
+    size_t done = 0;
+    while (done < n) {
+      const T* src;
+      size_t to_copy = min(read_span(&src), n - done);
+      if (!to_copy) break;
+      memcpy(data + done, src, to_copy * sizeof(T));
+      pop(to_copy);
+      done += to_copy;
+    }
+    return done;
+  }
+  // Drops everything currently in the buffer.
+  void clear() { store(begin_, load(end_)); }
+
+private:
+  static size_t load(const volatile size_t& x) {
+    return __atomic_load_n(&x, __ATOMIC_ACQUIRE);
+  }
+  static void store(volatile size_t& x, size_t v) {
+    __atomic_store_n(&x, v, __ATOMIC_RELEASE);
+  }
+
+  volatile size_t begin_ = 0;
+  volatile size_t end_ = 0;
+  T buffer_[N];
+};
+
+#endif
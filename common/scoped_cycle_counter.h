@@ -1,22 +1,22 @@
 #ifndef COMMON_SCOPED_CYCLE_COUNTER_H
 #define COMMON_SCOPED_CYCLE_COUNTER_H
 
+inline uint32_t GetCycleCount() {
+#ifdef TEENSYDUINO
+  return ARM_DWT_CYCCNT;
+#else
+  return DWT->CYCCNT;
+#endif
+}
+
 class ScopedCycleCounter {
 public:
   ScopedCycleCounter(uint64_t& dest) :
     dest_(dest) {
-#ifdef TEENSYDUINO
-    cycles_ = ARM_DWT_CYCCNT;
-#else
-    cycles_ = DWT->CYCCNT;
-#endif
+    cycles_ = GetCycleCount();
   }
   ~ScopedCycleCounter() {
-#ifdef TEENSYDUINO
-    cycles_ = ARM_DWT_CYCCNT - cycles_;
-#else
-    cycles_ = DWT->CYCCNT - cycles_;
-#endif
+    cycles_ = GetCycleCount() - cycles_;
     dest_ += cycles_;
   }
 private:
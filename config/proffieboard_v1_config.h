@@ -9,6 +9,11 @@
 #define PROFFIEBOARD
 #define USE_I2S
 #define GYRO_CLASS LSM6DS3H
+// Rendering preempts the SD reads in PendSV, but USB and the motion
+// sensor interrupts can still delay it. Plenty of RAM, give it more slack.
+#define AUDIO_RENDER_AHEAD_BLOCKS 8
+// Plenty of RAM, keep more clash and blast sounds preloaded.
+#define AUDIO_PRELOAD_BYTES 32768
 
 // Proffieboard pin map
 enum SaberPins {
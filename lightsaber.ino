@@ -245,6 +245,7 @@ public:
 
 uint64_t audio_dma_interrupt_cycles = 0;
 uint64_t wav_interrupt_cycles = 0;
+uint64_t audio_render_cycles = 0;
 uint64_t loop_cycles = 0;
 
 #include "common/loop_counter.h"
@@ -334,6 +335,8 @@ int16_t clamptoi16(int32_t x) {
 }
 
 #include "common/sin_table.h"
+#include "common/ring_buffer.h"
+#include "common/histogram.h"
 
 void EnableBooster();
 void EnableAmplifier();
@@ -419,6 +422,8 @@ char current_directory[128];
 #include "sound/effect.h"
 
 #define EFFECT(X) Effect X(#X)
+// Same, but keeps the start of every file in RAM, see AUDIO_PRELOAD_BYTES.
+#define PRELOAD_EFFECT(X) Effect X(#X, true)
 
 // Monophonic fonts
 EFFECT(boot);
@@ -427,20 +432,20 @@ EFFECT(hum);
 EFFECT(poweron);
 EFFECT(poweroff);
 EFFECT(pwroff);
-EFFECT(clash);
+PRELOAD_EFFECT(clash);
 EFFECT(force);
-EFFECT(stab);
-EFFECT(blaster);
-EFFECT(lockup);
+PRELOAD_EFFECT(stab);
+PRELOAD_EFFECT(blaster);
+PRELOAD_EFFECT(lockup);
 EFFECT(poweronf);
-EFFECT(font);
+PRELOAD_EFFECT(font);  // Plays right after switching presets.
 
 // Polyphonic fonts
-EFFECT(blst);
-EFFECT(clsh);
+PRELOAD_EFFECT(blst);
+PRELOAD_EFFECT(clsh);
 EFFECT(in);
 EFFECT(out);
-EFFECT(lock);
+PRELOAD_EFFECT(lock);
 EFFECT(swng);
 EFFECT(slsh);
 
@@ -456,27 +461,21 @@ EFFECT(drag);
 size_t WhatUnit(class BufferedWavPlayer* player);
 
 #include "sound/buffered_wav_player.h"
+#include "sound/voice_pool.h"
 
 BufferedWavPlayer wav_players[6];
+VoicePool<BufferedWavPlayer, NELEM(wav_players)> voice_pool(wav_players);
 
-RefPtr<BufferedWavPlayer> GetFreeWavPlayer()  {
-  // Find a free wave playback unit.
-  for (size_t unit = 0; unit < NELEM(wav_players); unit++) {
-    if (wav_players[unit].Available()) {
-      wav_players[unit].reset_volume();
-      return RefPtr<BufferedWavPlayer>(wav_players + unit);
-    }
-  }
-  return RefPtr<BufferedWavPlayer>();
+// May cut short a sound with the same or lower priority, never waits.
+RefPtr<BufferedWavPlayer> GetFreeWavPlayer(
+    VoicePriority priority = VOICE_NORMAL)  {
+  return voice_pool.Get(priority);
 }
 
 RefPtr<BufferedWavPlayer> RequireFreeWavPlayer()  {
-  while (true) {
-    RefPtr<BufferedWavPlayer> ret = GetFreeWavPlayer();
-    if (ret) return ret;
-    STDOUT.println("Failed to get hum player, trying again!");
-    delay(100);
-  }
+  RefPtr<BufferedWavPlayer> ret = GetFreeWavPlayer(VOICE_HIGH);
+  if (!ret) STDOUT.println("Failed to get hum player, all in use!");
+  return ret;
 }
 
 size_t WhatUnit(class BufferedWavPlayer* player) {
@@ -484,6 +483,7 @@ size_t WhatUnit(class BufferedWavPlayer* player) {
   return player - wav_players;
 }
 
+#include "sound/crossfade.h"
 #include "sound/audio_splicer.h"
 
 VolumeOverlay<AudioSplicer> audio_splicer;
@@ -499,6 +499,7 @@ void SetupStandardAudioLow() {
   }
   dynamic_mixer.streams_[NELEM(wav_players)] = &beeper;
   dynamic_mixer.streams_[NELEM(wav_players)+1] = &talkie;
+  AudioStream::Wake();
 }
 
 void SetupStandardAudio() {
@@ -559,6 +560,7 @@ public:
 SmoothSwingConfigFile smooth_swing_config;
 
 #include "sound/looped_swing_wrapper.h"
+#include "sound/swing_curve.h"
 #include "sound/smooth_swing_v2.h"
 
 LoopedSwingWrapper looped_swing_wrapper;
@@ -871,12 +873,18 @@ public:
     if (SaberBase::IsOn()) return;
     if (current_style() && current_style()->NoOnOff())
       return;
+    if (font_state_ != FONT_READY) {
+      // Ignite once the font is loaded, so the sounds aren't lost.
+      on_pending_ = true;
+      return;
+    }
     STDOUT.println("Ignition.");
     EnableAmplifier();
     SaberBase::TurnOn();
   }
 
   void Off() {
+    on_pending_ = false;
     if (SaberBase::Lockup()) {
       SaberBase::SetLockup(SaberBase::LOCKUP_NONE);
       SaberBase::DoEndLockup();
@@ -904,7 +912,10 @@ public:
     last_clash_ = t;
   }
 
-  bool chdir(const char* dir) {
+  // Switches to a new font directory. Only the sounds stop right away,
+  // the font itself is loaded a little at a time from Loop(), so that
+  // the blades keep going meanwhile. See LoadFont().
+  bool chdir(const char* dir, bool announce = false) {
     if (strlen(dir) > 1 && dir[strlen(dir)-1] == '/') {
       STDOUT.println("Directory must not end with slash.");
       return false;
@@ -930,35 +941,119 @@ public:
     }
 
 #ifdef ENABLE_AUDIO
-    Effect::ScanDirectory(dir);
-    SaberBase* font = NULL;
-    if (clsh.files_found()) {
-      polyphonic_font.Activate();
-      font = &polyphonic_font;
-    } else if (clash.files_found()) {
-      monophonic_font.Activate();
-      font = &monophonic_font;
-    } else if (boot.files_found()) {
-      monophonic_font.Activate();
-      font = &monophonic_font;
-    }
-    if (font) {
-      if (swingl.files_found()) {
-        smooth_swing_config.ReadInCurrentDir("smoothsw.ini");
-        switch (smooth_swing_config.Version) {
-          case 1:
-            looped_swing_wrapper.Activate(font);
-            break;
-          case 2:
-            smooth_swing_v2.Activate(font);
-            break;
-        }
-      }
-    }
+    Effect::BeginScan(dir);
 #endif
+    font_state_ = FONT_SCANNING;
+    announce_font_ = announce;
     return false;
   }
 
+  enum FontState {
+    FONT_READY,
+    FONT_SCANNING,
+    FONT_ACTIVATE,
+    FONT_ACTIVATE_SWING,
+    FONT_SET_STYLE,
+  };
+
+  // Does one step of loading the font that chdir() started.
+  // Each step is short enough to not make the blades hitch.
+  void LoadFont() {
+    switch (font_state_) {
+      case FONT_READY:
+        return;
+      case FONT_SCANNING:
+#ifdef ENABLE_AUDIO
+        if (Effect::ScanStep()) return;
+#endif
+        font_state_ = FONT_ACTIVATE;
+        return;
+      case FONT_ACTIVATE:
+#ifdef ENABLE_AUDIO
+        font_ = NULL;
+        if (clsh.files_found()) {
+          polyphonic_font.Activate();
+          font_ = &polyphonic_font;
+        } else if (clash.files_found()) {
+          monophonic_font.Activate();
+          font_ = &monophonic_font;
+        } else if (boot.files_found()) {
+          monophonic_font.Activate();
+          font_ = &monophonic_font;
+        }
+#endif
+        font_state_ = FONT_ACTIVATE_SWING;
+        return;
+      case FONT_ACTIVATE_SWING:
+#ifdef ENABLE_AUDIO
+        if (font_ && swingl.files_found()) {
+          smooth_swing_config.ReadInCurrentDir("smoothsw.ini");
+          switch (smooth_swing_config.Version) {
+            case 1:
+              looped_swing_wrapper.Activate(font_);
+              break;
+            case 2:
+              smooth_swing_v2.Activate(font_);
+              break;
+          }
+        }
+#endif
+        font_state_ = FONT_SET_STYLE;
+        return;
+      case FONT_SET_STYLE:
+        // The old style keeps running until the new font is ready.
+        if (style_pending_) SetStyle();
+        font_state_ = FONT_READY;
+        if (announce_font_) SaberBase::DoNewFont();
+        if (on_pending_) {
+          on_pending_ = false;
+          On();
+        }
+        return;
+    }
+  }
+
+  // Loads the rest of the font right away.
+  void FinishLoadingFont() {
+    while (font_state_ != FONT_READY) LoadFont();
+  }
+
+  void SetStyle() {
+    style_pending_ = false;
+    // First free all styles, then allocate new ones to avoid memory
+    // fragmentation.
+#define UNSET_BLADE_STYLE(N) \
+    delete current_config_->blade##N->UnSetStyle();
+    ONCEPERBLADE(UNSET_BLADE_STYLE)
+#define SET_BLADE_STYLE(N) \
+    current_config_->blade##N->SetStyle(current_preset_->style_allocator##N->make());
+    ONCEPERBLADE(SET_BLADE_STYLE)
+  }
+
+#ifdef ENABLE_AUDIO
+  // Keeps the index of the fonts for the next and previous presets
+  // in RAM, so that switching to them doesn't wait for the SD card.
+  // Only while the saber is off and quiet, as it competes with the
+  // sound for the SD card.
+  void Prefetch() {
+    if (font_state_ != FONT_READY || SaberBase::IsOn()) return;
+    if (audio_splicer.isPlaying()) return;
+    for (size_t i = 0; i < NELEM(wav_players); i++) {
+      if (wav_players[i].isPlaying()) return;
+    }
+    if (current_config_->num_presets < 2) return;
+    Preset* next = current_preset_ + 1;
+    if (next == current_config_->presets + current_config_->num_presets) {
+      next = current_config_->presets;
+    }
+    Preset* prev = current_preset_ - 1;
+    if (prev == current_config_->presets - 1) {
+      prev = current_config_->presets + current_config_->num_presets - 1;
+    }
+    Effect::Prefetch(next->font, prev->font);
+  }
+#endif
+
   // Select preset (font/style)
   void SetPreset(Preset* preset, bool announce) {
     if (announce) {
@@ -978,16 +1073,13 @@ public:
     }
 
     current_preset_ = preset;
-
-    // First free all styles, then allocate new ones to avoid memory
-    // fragmentation.
-#define UNSET_BLADE_STYLE(N) \
-    delete current_config_->blade##N->UnSetStyle();
-    ONCEPERBLADE(UNSET_BLADE_STYLE)
-#define SET_BLADE_STYLE(N) \
-    current_config_->blade##N->SetStyle(preset->style_allocator##N->make());
-    ONCEPERBLADE(SET_BLADE_STYLE)
-    chdir(preset->font);
+    // At boot there is no old style to keep running.
+    if (current_style()) {
+      style_pending_ = true;
+    } else {
+      SetStyle();
+    }
+    chdir(preset->font, announce);
   }
 
   // Go to the next Preset.
@@ -1002,7 +1094,6 @@ public:
       tmp = current_config_->presets;
     }
     SetPreset(tmp, true);
-    SaberBase::DoNewFont();
   }
 
   // Go to the previous Preset.
@@ -1017,7 +1108,6 @@ public:
       tmp = current_config_->presets + current_config_->num_presets - 1;
     }
     SetPreset(tmp, true);
-    SaberBase::DoNewFont();
   }
 
   // Measure and return the blade identifier resistor.
@@ -1243,6 +1333,10 @@ protected:
   uint32_t last_beep_;
 
   void Loop() override {
+    LoadFont();
+#ifdef ENABLE_AUDIO
+    Prefetch();
+#endif
     if (battery_monitor.low()) {
       if (current_preset_->style_allocator1 != &style_charging) {
         if (SaberBase::IsOn()) {
@@ -1554,6 +1648,10 @@ public:
       STDOUT.println(audio_splicer.volume());
       return true;
     }
+    if (!strcmp(cmd, "prefetch_stats")) {
+      Effect::PrintPrefetchStats();
+      return true;
+    }
     if (!strcmp(cmd, "buffered")) {
       for (size_t unit = 0; unit < NELEM(wav_players); unit++) {
         STDOUT.print(" Unit ");
@@ -1563,10 +1661,63 @@ public:
       }
       return true;
     }
+    if (!strcmp(cmd, "audio_stats")) {
+      if (arg && !strcmp(arg, "clear")) {
+        for (size_t unit = 0; unit < NELEM(wav_players); unit++)
+          wav_players[unit].ClearStats();
+        dac.ClearStats();
+        return true;
+      }
+      for (size_t unit = 0; unit < NELEM(wav_players); unit++) {
+        STDOUT.print(" Unit ");
+        STDOUT.print(unit);
+        STDOUT.print(" underruns: ");
+        STDOUT.print(wav_players[unit].underruns());
+        STDOUT.print(" min buffered: ");
+        STDOUT.print(wav_players[unit].min_buffered());
+        STDOUT.print(" fill latency avg: ");
+        STDOUT.print(wav_players[unit].avg_fill_latency_us());
+        STDOUT.print("us max: ");
+        STDOUT.print(wav_players[unit].max_fill_latency_us());
+        STDOUT.println("us");
+      }
+      STDOUT.print(" stolen voices: ");
+      STDOUT.println(voice_pool.steals());
+      dac.PrintStats();
+      return true;
+    }
+    if (!strcmp(cmd, "get_audio_stats")) {
+      // One KEY=VALUE per line, per-unit values are comma separated.
+      STDOUT.print("UNDERRUNS=");
+      for (size_t unit = 0; unit < NELEM(wav_players); unit++) {
+        if (unit) STDOUT.print(",");
+        STDOUT.print(wav_players[unit].underruns());
+      }
+      STDOUT.println("");
+      STDOUT.print("MIN_BUFFERED=");
+      for (size_t unit = 0; unit < NELEM(wav_players); unit++) {
+        if (unit) STDOUT.print(",");
+        STDOUT.print(wav_players[unit].min_buffered());
+      }
+      STDOUT.println("");
+      STDOUT.print("AVG_FILL_LATENCY_US=");
+      for (size_t unit = 0; unit < NELEM(wav_players); unit++) {
+        if (unit) STDOUT.print(",");
+        STDOUT.print(wav_players[unit].avg_fill_latency_us());
+      }
+      STDOUT.println("");
+      STDOUT.print("MAX_FILL_LATENCY_US=");
+      for (size_t unit = 0; unit < NELEM(wav_players); unit++) {
+        if (unit) STDOUT.print(",");
+        STDOUT.print(wav_players[unit].max_fill_latency_us());
+      }
+      STDOUT.println("");
+      dac.PrintStatsMachine();
+      return true;
+    }
 #endif
     if (!strcmp(cmd, "cd")) {
-      chdir(arg);
-      SaberBase::DoNewFont();
+      chdir(arg, true);
       return true;
     }
 #if 0
@@ -1629,7 +1780,6 @@ public:
         Preset *p = current_config_->presets + preset;
         if (p != current_preset_) {
           SetPreset(p, true);
-          SaberBase::DoNewFont();
         }
       }
       return true;
@@ -1689,12 +1839,22 @@ public:
     STDOUT.println(" next/prev font - walk through directories in alphabetical order");
     STDOUT.println(" next/prev pre[set] - walk through presets.");
     STDOUT.println(" beep - play a beep");
+    STDOUT.println(" audio_stats [clear] - underruns, buffer and interrupt timing");
+    STDOUT.println(" prefetch_stats - preset prefetch hits and misses");
 #endif
   }
 
 private:
   BladeConfig* current_config_ = NULL;
   Preset* current_preset_ = NULL;
+  FontState font_state_ = FONT_READY;
+  bool style_pending_ = false;
+  bool announce_font_ = false;
+  // On() was called while the font was loading.
+  bool on_pending_ = false;
+#ifdef ENABLE_AUDIO
+  SaberBase* font_ = NULL;
+#endif
 };
 
 Saber saber;
@@ -1859,6 +2019,9 @@ class Commands : public CommandParser {
 	STDOUT.print(" kb/s = ");
 	STDOUT.print(kb_per_sec / 88.2);
 	STDOUT.println(" simultaneous audio streams.");
+	// IMA ADPCM, 4 bits per sample plus block headers.
+	STDOUT.print(kb_per_sec / 22.2);
+	STDOUT.println(" simultaneous IMA ADPCM streams.");
       }
       LOCK_SD(false);
       return true;
@@ -2012,11 +2175,15 @@ class Commands : public CommandParser {
       // TODO: list cpu usage for various objects.
       double total_cycles =
         (double)(audio_dma_interrupt_cycles +
+                 audio_render_cycles +
                  wav_interrupt_cycles +
                  loop_cycles);
       STDOUT.print("Audio DMA: ");
       STDOUT.print(audio_dma_interrupt_cycles * 100.0 / total_cycles);
       STDOUT.println("%");
+      STDOUT.print("Audio mixing: ");
+      STDOUT.print(audio_render_cycles * 100.0 / total_cycles);
+      STDOUT.println("%");
       STDOUT.print("Wav reading: ");
       STDOUT.print(wav_interrupt_cycles * 100.0 / total_cycles);
       STDOUT.println("%");
@@ -2030,6 +2197,7 @@ class Commands : public CommandParser {
       Looper::LoopTop(total_cycles);
       noInterrupts();
       audio_dma_interrupt_cycles = 0;
+      audio_render_cycles = 0;
       wav_interrupt_cycles = 0;
       loop_cycles = 0;
       interrupts();
@@ -2435,6 +2603,8 @@ void setup() {
   Looper::DoSetup();
   // Time to identify the blade.
   saber.FindBlade();
+  // The boot sound needs the font.
+  saber.FinishLoadingFont();
   SaberBase::DoBoot();
 #if defined(ENABLE_SD) && defined(ENABLE_AUDIO)
   if (!sd_card_found) {
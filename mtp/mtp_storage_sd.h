@@ -119,23 +119,24 @@ private:
   void ScanDir(uint32_t i) {
     Record record = ReadIndexRecord(i);
     if (record.isdir && !record.scanned) {
-      OpenFileByIndex(i);
-      if (!f_) return;
+      char filename[256];
+      ConstructFilename(i, filename);
       int sibling = 0;
-      while (true) {
-        mtp_lock_storage(true);
-        File child = f_.openNextFile();
-        mtp_lock_storage(false);
-        if (!child) break;
+      mtp_lock_storage(true);
+      LSFS::Iterator child(filename);
+      mtp_lock_storage(false);
+      while (child) {
         Record r;
         r.parent = i;
         r.sibling = sibling;
-        r.isdir = child.isDirectory();
+        r.isdir = child.isdir();
         r.child = r.isdir ? 0 : child.size();
         r.scanned = false;
         strcpy(r.name, child.name());
         sibling = AppendIndexRecord(r);
-        child.close();
+        mtp_lock_storage(true);
+        ++child;
+        mtp_lock_storage(false);
       }
       record.scanned = true;
       record.child = sibling;
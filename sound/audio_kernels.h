@@ -0,0 +1,77 @@
+#ifndef SOUND_AUDIO_KERNELS_H
+#define SOUND_AUDIO_KERNELS_H
+
+// Block-oriented sample loops used by the mixing stages.
+// These are kept free of state so that they can be tested
+// and benchmarked on the host.
+
+#include <stdint.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Adds |elements| 16-bit samples from |src| into the 32-bit
+// accumulator |sum|.
+inline void MixAdd(int32_t* sum, const int16_t* src, int elements) {
+  int i = 0;
+#if defined(__SSE2__)
+  for (; i + 8 <= elements; i += 8) {
+    __m128i s = _mm_loadu_si128((const __m128i*)(src + i));
+    __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(s, s), 16);
+    __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(s, s), 16);
+    __m128i* d = (__m128i*)(sum + i);
+    _mm_storeu_si128(d, _mm_add_epi32(_mm_loadu_si128(d), lo));
+    _mm_storeu_si128(d + 1, _mm_add_epi32(_mm_loadu_si128(d + 1), hi));
+  }
+#elif defined(__ARM_FEATURE_DSP)
+  // One 32-bit load gives us two samples, the compiler turns
+  // the sign extensions into SXTAH / ASR+ADD.
+  for (; i + 2 <= elements; i += 2) {
+    int32_t pair;
+    memcpy(&pair, src + i, sizeof(pair));
+    sum[i] += (int16_t)pair;
+    sum[i + 1] += pair >> 16;
+  }
+#endif
+  for (; i < elements; i++) sum[i] += src[i];
+}
+
+// Like MixAdd(), but multiplies each sample with |mult| >> |shift|
+// and clamps it to 16 bits before adding it.
+inline void MixAddScaled(int32_t* sum, const int16_t* src, int elements,
+                         int32_t mult, int shift) {
+  for (int i = 0; i < elements; i++) {
+    sum[i] += clamptoi16((src[i] * mult) >> shift);
+  }
+}
+
+// Returns the sum of absolute values of |sum[0..elements)| and
+// stores the largest absolute value in |*peak|.
+inline int32_t AbsSumAndPeak(const int32_t* sum, int elements, int32_t* peak) {
+  int32_t total = 0;
+  int32_t p = *peak;
+  for (int i = 0; i < elements; i++) {
+    int32_t v = sum[i];
+    int32_t a = v < 0 ? -v : v;
+    total += a;
+    if (a > p) p = a;
+  }
+  *peak = p;
+  return total;
+}
+
+// Multiplies |sum| with a gain that moves linearly from |gain| by |delta|
+// per sample, then clamps the results to 16 bits. Gain is 16.16 fixed point.
+// Returns the gain after the last sample.
+inline int32_t ApplyGainRamp(const int32_t* sum, int16_t* out, int elements,
+                             int32_t gain, int32_t delta) {
+  for (int i = 0; i < elements; i++) {
+    gain += delta;
+    out[i] = clamptoi16((int32_t)(((int64_t)sum[i] * gain) >> 16));
+  }
+  return gain;
+}
+
+#endif
@@ -1,8 +1,15 @@
 #ifndef SOUND_AUDIO_SPLICER_H
 #define SOUND_AUDIO_SPLICER_H
 
+// Length of the crossfade when the AudioSplicer cuts from one sound to
+// another.
+#ifndef AUDIO_SPLICE_FADE_MS
+#define AUDIO_SPLICE_FADE_MS 3
+#endif
+
 // This class is used to cut from one sound to another with
-// no gap. It does a short (2.5ms) crossfade to accomplish this.
+// no gap. It does a short equal-power crossfade to accomplish this,
+// see AUDIO_SPLICE_FADE_MS.
 class AudioSplicer : public AudioStream, Looper {
 public:
   AudioSplicer() : Looper(NOLINK) {}
@@ -19,7 +26,8 @@ public:
 	dynamic_mixer.streams_[i] = nullptr;
       }
     }
-    set_crossover_time(0.003);
+    Wake();
+    set_crossover_time(AUDIO_SPLICE_FADE_MS / 1000.0);
   }
 
   void Deactivate() {
@@ -57,17 +65,13 @@ public:
         int n = min(to_read, (int)NELEM(tmp));
         int num = players_[fadeto_]->read(tmp, n);
         while (num < n) tmp[num++] = 0;
-        for (int i = 0; i < num; i++) {
-          p[i] = (p[i] * fade_ + tmp[i] * (32768 - fade_)) >> 15;
-          if (fade_) {
-            fade_ -= fade_speed_;
-            if (fade_ < 0) fade_ = 0;
-          }
-        }
+        int faded = min(n, fade_.remaining());
+        fade_.Apply(p, tmp, faded);
+        memcpy(p + faded, tmp + faded, (n - faded) * sizeof(tmp[0]));
         to_read -= n;
         p += n;
       }
-      if (!fade_) {
+      if (fade_.done()) {
         if (current_ != -1)
           players_[current_]->Stop();
         current_ = fadeto_;
@@ -82,11 +86,7 @@ public:
   }
 
   void set_crossover_time(float t) {
-    fade_speed_ = max(1, (int)(32768 / t / AUDIO_RATE));
-#if 0
-    STDOUT.print("FADE SPEED: ");
-    STDOUT.println(fade_speed_);
-#endif
+    fade_.set_length(t * AUDIO_RATE);
   }
 
   Effect* next_effect_ = NULL;
@@ -118,22 +118,23 @@ public:
     if (current_ == -1) {
       current_ = unit;
     } else {
+      fade_.Start();
       fadeto_ = unit;
-      fade_ = 32768;
     }
+    Wake();
     return true;
   }
 
   bool isPlaying() const {
     return current_ != -1 || fadeto_ != -1;
   }
+  bool IsActive() const override { return isPlaying(); }
 
 protected:
   RefPtr<BufferedWavPlayer> players_[2];
   volatile int current_= -1;
   volatile int fadeto_ = -1;
-  volatile int fade_speed_ = 128;
-  volatile int fade_;
+  Crossfade fade_;
 };
 
 #endif
@@ -6,6 +6,13 @@
 // let audio processing preempt less important tasks.
 #define IRQ_WAV 55
 
+// Max number of samples to fill per interrupt. Once this is spent,
+// the remaining streams wait until the next time we're triggered,
+// which gives lower priority work a chance to run.
+#ifndef AUDIO_FILL_BUDGET
+#define AUDIO_FILL_BUDGET 2048
+#endif
+
 class AudioStreamWork;
 AudioStreamWork* data_streams;
 
@@ -24,6 +31,7 @@ public:
     for (AudioStreamWork** d = &data_streams; *d; d = &(*d)->next_) {
       if (*d == this) {
         *d = next_;
+        break;
       }
     }
   }
@@ -43,33 +51,71 @@ public:
   }
 
 protected:
-  virtual bool FillBuffer() = 0;
+  // Returns the number of samples added.
+  virtual int FillBuffer() = 0;
   virtual size_t space_available() const = 0;
+  virtual int buffered() const = 0;
 
 private:
+  // Every buffer holds samples at AUDIO_RATE, even for resampled
+  // files, so the stream with the fewest buffered samples is the
+  // one that runs dry first.
+  struct FillRequest {
+    int buffered;
+    AudioStreamWork* stream;
+  };
+  static const size_t kMaxStreams = 16;
+
+  // Binary min-heap on buffered.
+  static void HeapPush(FillRequest* heap, size_t* n, FillRequest r) {
+    size_t i = (*n)++;
+    while (i && heap[(i - 1) / 2].buffered > r.buffered) {
+      heap[i] = heap[(i - 1) / 2];
+      i = (i - 1) / 2;
+    }
+    heap[i] = r;
+  }
+  static FillRequest HeapPop(FillRequest* heap, size_t* n) {
+    FillRequest ret = heap[0];
+    FillRequest last = heap[--*n];
+    size_t i = 0;
+    while (true) {
+      size_t child = i * 2 + 1;
+      if (child >= *n) break;
+      if (child + 1 < *n && heap[child + 1].buffered < heap[child].buffered)
+        child++;
+      if (heap[child].buffered >= last.buffered) break;
+      heap[i] = heap[child];
+      i = child;
+    }
+    heap[i] = last;
+    return ret;
+  }
+
+  // Fills the stream closest to running dry first. Each fill is as
+  // large as the stream allows, so that we stay with one file as
+  // long as possible, which saves SD seeks.
   static void ProcessAudioStreams() {
     ScopedCycleCounter cc(wav_interrupt_cycles);
     if (sd_locked) return;
-#if 1
-    // Yes, it's a selection sort, luckily there's not a lot of
-    // AudioStreamWork instances.
-    for (int i = 0; i < 50; i++) {
-      size_t max_space = 0;
-      for (AudioStreamWork *d = data_streams; d; d=d->next_)
-        max_space = max(max_space, d->space_available());
-      if (max_space == 0) break;
-      for (AudioStreamWork *d = data_streams; d; d=d->next_) {
-        if (d->space_available() >= max_space)
-          d->FillBuffer();
+    FillRequest heap[kMaxStreams];
+    size_t n = 0;
+    for (AudioStreamWork *d = data_streams; d && n < kMaxStreams; d=d->next_) {
+      if (d->space_available()) {
+        FillRequest r = { d->buffered(), d };
+        HeapPush(heap, &n, r);
       }
     }
-#else
-    for (int i = 0; i < 10; i++) {
-      for (AudioStreamWork *d = data_streams; d; d=d->next_) {
-        d->FillBuffer();
+    int budget = AUDIO_FILL_BUDGET;
+    while (n && budget > 0) {
+      FillRequest r = HeapPop(heap, &n);
+      int filled = r.stream->FillBuffer();
+      budget -= filled;
+      if (filled > 0 && r.stream->space_available()) {
+        r.buffered = r.stream->buffered();
+        HeapPush(heap, &n, r);
       }
     }
-#endif
   }
 
   static volatile bool sd_locked;
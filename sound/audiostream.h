@@ -2,6 +2,7 @@
 #define SOUND_AUDIOSTREAM_H
 
 #include <stdint.h>
+#include "audio_kernels.h"
 
 class AudioStream {
 public:
@@ -10,6 +11,34 @@ public:
   virtual bool eof() const { return false; }
   // Stop
   virtual void Stop() {}
+  // Reads up to |elements| samples and adds them to |sum|.
+  // |scratch| must have room for |elements| samples, streams that
+  // can accumulate straight from their own memory don't use it.
+  // Returns the number of samples added.
+  virtual int mix(int32_t* sum, int16_t* scratch, int elements) {
+    int e = read(scratch, elements);
+    MixAdd(sum, scratch, e);
+    return e;
+  }
+
+  // Returns false when read() would only produce silence.
+  // The mixer does not read idle streams, so a stream which can
+  // return false here must call Wake() when it starts playing again.
+  virtual bool IsActive() const { return true; }
+  // Returns true when read() produces only zeroes, but still needs
+  // to be called to keep the stream going. Muted streams are read
+  // but not summed.
+  virtual bool IsMuted() const { return false; }
+
+  // Tells the mixer that some stream may have become active.
+  static void Wake() { wake_count()++; }
+  static volatile uint32_t& wake_count() {
+    static volatile uint32_t count = 0;
+    return count;
+  }
+
+  // Used by the mixer to link together active streams.
+  AudioStream* next_active_ = nullptr;
 };
 
 #endif
@@ -30,11 +30,13 @@ public:
     digitalWrite(amplifierPin, HIGH); // turn on the amplifier
     x_ = f_ = AUDIO_RATE / freq / 2.0;
     samples_ = AUDIO_RATE * length;
+    Wake();
   }
 
-  bool isPlaying() {
+  bool isPlaying() const {
     return samples_ > 0;
   }
+  bool IsActive() const override { return isPlaying(); }
 
 private:  
   volatile int samples_ = 0;
@@ -8,13 +8,15 @@
 // to handle filling up the buffer at a lower interrupt level. Since
 // filling up the buffer can mean reading from SD, there can potentially
 // be more reads from the buffer while we're working on filling it up.
-// To make this work, we need make sure that the end pointer for the buffer
-// is only modified in the FillBuffer() function and the begin pointer is
-// only modified in read();
+// The samples are kept in a RingBuffer, where FillBuffer() is the only
+// producer and read() / consume() is the only consumer.
 // N needs to be power of 2
 template<int N>
 class BufferedAudioStream : public AudioStream, public AudioStreamWork {
 public:
+  // 1.5ms
+  static const int kFadeOutSamples = 64;
+
   BufferedAudioStream() : AudioStreamWork() {
   }
   int read(int16_t* buf, int bufsize) override {
@@ -22,67 +24,147 @@ public:
     // Disable buffer
     return stream_ ? stream_->read(buf, bufsize) : 0;
 #else
-    int copied = 0;
-    while (bufsize) {
-      int to_copy = buffered();
-      if (!to_copy) break;
-      to_copy = min(to_copy, bufsize);
-      int start_pos = buf_start_ & (N-1);
-      to_copy = min(to_copy, N - start_pos);
-      memcpy(buf, buffer_ + start_pos, sizeof(buf[0]) * to_copy);
-      copied += to_copy;
-      buf_start_ += to_copy;
-      buf += to_copy;
-      bufsize -= to_copy;
-    }
-    scheduleFillBuffer();
+    int copied = buffer_.read(buf, bufsize);
+    faded_tail_ -= min(copied, faded_tail_);
+    UpdateReadStats(bufsize, copied);
+    RequestFill();
     return copied;
 #endif
   }
+  // Zero-copy read: points |*data| at the buffered samples and
+  // returns how many are contiguous in memory. The samples stay
+  // valid until consume() is called. Must be called from the same
+  // context as read().
+  int peek(const int16_t** data) const {
+    return buffer_.read_span(data);
+  }
+  // Releases |elements| samples returned by peek().
+  void consume(int elements) {
+    buffer_.pop(elements);
+    faded_tail_ -= min(elements, faded_tail_);
+    RequestFill();
+  }
   bool eof() const override {
     return !buffered() && eof_;
   }
   void Stop() override { if (!stream_) stream_->Stop(); }
   void clear() {
     eof_ = false;
-    buf_start_ = buf_end_;
+    started_ = false;
+    buffer_.clear();
     stream_ = NULL;
+    faded_tail_ = 0;
   }
-  int buffered() const {
-    return buf_end_ - buf_start_;
+  // Like clear(), but keeps the next few buffered samples and fades
+  // them out, so that cutting a sound short doesn't click. The tail
+  // is also multiplied by |mult| >> |shift|, so that it can be
+  // played without any further volume changes, see faded_tail().
+  void clear_with_fade(int32_t mult = 1, int shift = 0) {
+    stream_ = NULL;
+    int16_t tail[kFadeOutSamples];
+    if (faded_tail_) {
+      // Still fading out the last one, so nothing after that
+      // has been heard yet.
+      int n = buffer_.read(tail, faded_tail_);
+      clear();
+      buffer_.write(tail, n);
+      faded_tail_ = n;
+      return;
+    }
+    int n = buffer_.read(tail, NELEM(tail));
+    clear();
+    for (int i = 0; i < n; i++) {
+      tail[i] = clamptoi16(
+          ((int32_t)tail[i] * (n - i) / (n + 1) * mult) >> shift);
+    }
+    buffer_.write(tail, n);
+    faded_tail_ = n;
+  }
+  // Number of buffered samples left from clear_with_fade().
+  int faded_tail() const { return faded_tail_; }
+  int buffered() const override {
+    return buffer_.size();
   }
   size_t space_available() const override {
     if (eof_ || !stream_) return 0;
-    return N - buffered();
+    return buffer_.space();
   }
   void SetStream(AudioStream* stream) {
     eof_ = false;
     stream_ = stream;
   }
+
+  // Health counters, see "audio_stats".
+  // Reads that got less data than asked for, while the
+  // stream was still playing.
+  uint32_t underruns() const { return underruns_; }
+  // Lowest number of buffered samples seen after a read.
+  int min_buffered() const { return min_buffered_; }
+  // Time from a read freeing up space to the buffer being filled.
+  uint32_t max_fill_latency_us() const { return max_fill_latency_; }
+  uint32_t avg_fill_latency_us() const {
+    return fills_ ? fill_latency_sum_ / fills_ : 0;
+  }
+  void ClearStats() {
+    underruns_ = 0;
+    min_buffered_ = N;
+    max_fill_latency_ = 0;
+    fill_latency_sum_ = 0;
+    fills_ = 0;
+  }
+
+protected:
+  // Call after reading |got| samples, when |wanted| were requested.
+  // Nothing counts until the first fill after clear(), so starting
+  // a new sound isn't an underrun.
+  void UpdateReadStats(int wanted, int got) {
+    if (!started_) return;
+    if (got < wanted && stream_ && !eof_ && !stream_->eof()) underruns_++;
+    int b = buffered();
+    if (b < min_buffered_) min_buffered_ = b;
+  }
+  void RequestFill() {
+    if (!fill_requested_) fill_requested_ = micros() | 1;
+    scheduleFillBuffer();
+  }
+
 private:
-  bool FillBuffer() override {
-    if (stream_) {
-      size_t space = space_available();
-      if (space) {
-        size_t end_pos = buf_end_ & (N-1);
-        size_t to_read = min(space, N - end_pos);
-        int got = stream_->read(buffer_ + end_pos, to_read);
-        if (got) {
-          eof_ = false;
-        } else {
-          eof_ = stream_->eof();
-        }
-        buf_end_ += got;
-      }
+  int FillBuffer() override {
+    // The requester and the filler race on fill_requested_, at worst
+    // we lose one measurement.
+    uint32_t requested = fill_requested_;
+    if (requested) {
+      fill_requested_ = 0;
+      uint32_t latency = micros() - requested;
+      if (latency > max_fill_latency_) max_fill_latency_ = latency;
+      fill_latency_sum_ += latency;
+      fills_++;
     }
-    return stream_ && space_available() > 0 && !eof_;
+    if (!stream_ || !space_available()) return 0;
+    int16_t* dest;
+    size_t to_read = buffer_.write_span(&dest);
+    int got = stream_->read(dest, to_read);
+    if (got) {
+      eof_ = false;
+    } else {
+      eof_ = stream_->eof();
+    }
+    buffer_.push(got);
+    if (got) started_ = true;
+    return got;
   }
   AudioStream* volatile stream_ = 0;
-  // Note, these are assumed to be atomic, 8-bit processors won't work.
-  volatile size_t buf_start_ = 0;
-  volatile size_t buf_end_ = 0;
   volatile bool eof_ = false;
-  int16_t buffer_[N];
+  volatile bool started_ = false;
+  volatile int faded_tail_ = 0;
+  RingBuffer<int16_t, N> buffer_;
+
+  volatile uint32_t fill_requested_ = 0;
+  volatile uint32_t underruns_ = 0;
+  volatile int min_buffered_ = N;
+  volatile uint32_t max_fill_latency_ = 0;
+  volatile uint32_t fill_latency_sum_ = 0;
+  volatile uint32_t fills_ = 0;
 };
 
 #endif
@@ -4,19 +4,35 @@
 #include "playwav.h"
 #include "volume_overlay.h"
 
+#ifndef VOICE_VIRTUALIZE_MS
+// Looping sounds that stay silent this long stop reading from the
+// SD card. 0 turns it off.
+#define VOICE_VIRTUALIZE_MS 100
+#endif
+
 // Combines a WavPlayer and a BufferedAudioStream into a
 // buffered wav player. When we start a new sample, we
 // make sure to fill up the buffer before we start playing it.
 // This minimizes latency while making sure to avoid any gaps.
+//
+// A looping sound that has been muted for VOICE_VIRTUALIZE_MS goes
+// virtual: it stops reading and decoding, and just counts the samples
+// it would have played. When the volume goes up again, it seeks to
+// where it would have been by then, and the volume ramps up from zero.
+// Sounds that have to come back without delay can call Prepare()
+// shortly before they get loud, like SmoothSwingV2 does when a swing
+// is about to start, or opt out with set_virtualize(false).
 class BufferedWavPlayer : public VolumeOverlay<BufferedAudioStream<512> > {
 public:
   void Play(const char* filename) {
     pause_ = true;
-    clear();
+    virtual_ = false;
+    ClearForNewSound();
     wav.Play(filename);
     SetStream(&wav);
     scheduleFillBuffer();
     pause_ = false;
+    Wake();
   }
 
   void PlayOnce(Effect* effect, float start = 0.0) {
@@ -27,20 +43,34 @@ public:
     STDOUT.print(", ");
 
     pause_ = true;
-    clear();
+    virtual_ = false;
+    ClearForNewSound();
     wav.PlayOnce(effect, start);
     SetStream(&wav);
     scheduleFillBuffer();
     pause_ = false;
+    Wake();
   }
   void PlayLoop(Effect* effect) { wav.PlayLoop(effect); }
 
   void Stop() override {
     pause_ = true;
+    virtual_ = false;
     wav.Stop();
     clear();
   }
 
+  // Stops the current sound with a short fade at its current
+  // volume. The fade plays before the next sound starts, so the
+  // volume can be changed for that one right away.
+  void CutShort() {
+    pause_ = true;
+    virtual_ = false;
+    wav.Stop();
+    clear_with_fade();
+    pause_ = false;
+  }
+
   const char* Filename() const {
     return wav.Filename();
   }
@@ -48,16 +78,91 @@ public:
   bool isPlaying() const {
     return !pause_ && (wav.isPlaying() || buffered());
   }
+  bool IsActive() const override { return isPlaying(); }
 
   BufferedWavPlayer() {
     SetStream(&wav);
   }
 
+  // Muted streams are read() by the mixer, so this is where
+  // voices go virtual.
   int read(int16_t* dest, int to_read) override {
     if (pause_) return 0;
+    if (faded_tail()) {
+      // Volume is already applied, see CutShort().
+      int n = BufferedAudioStream<512>::read(dest, min(to_read, faded_tail()));
+      if (n == to_read || faded_tail()) return n;
+      return n + read(dest + n, to_read - n);
+    }
+    if (virtual_) {
+      if (!stopping()) {
+        virtual_samples_ += to_read;
+        memset(dest, 0, to_read * sizeof(dest[0]));
+        return to_read;
+      }
+      // FadeAndStop() was called, let VolumeOverlay stop it.
+      virtual_ = false;
+    }
+    if (isOff()) {
+      muted_samples_ += to_read;
+      if (VOICE_VIRTUALIZE_MS && virtualize_ && !stopping() &&
+          muted_samples_ > VOICE_VIRTUALIZE_MS * AUDIO_RATE / 1000 &&
+          wav.loop_effect() && wav.file_id()) {
+        virtual_start_ = wav.position() - buffered() * (1.0f / AUDIO_RATE);
+        virtual_samples_ = to_read;
+        virtual_ = true;
+        memset(dest, 0, to_read * sizeof(dest[0]));
+        return to_read;
+      }
+    } else {
+      muted_samples_ = 0;
+    }
     return VolumeOverlay<BufferedAudioStream<512> >::read(dest, to_read);
   }
 
+  int mix(int32_t* sum, int16_t* scratch, int elements) override {
+    // A virtual voice makes no sound until Resume() has restarted it.
+    if (pause_ || virtual_) return 0;
+    muted_samples_ = 0;
+    return MixFromBuffer(sum, elements);
+  }
+
+  // The target volume is set before looking at virtual_, so a voice
+  // can't go virtual after we've decided not to resume it.
+  void set_volume(int vol) {
+    VolumeOverlay<BufferedAudioStream<512> >::set_volume(vol);
+    if (vol && virtual_) Resume();
+  }
+  void set_volume(float vol) {
+    set_volume((int)(kDefaultVolume * vol));
+  }
+  void set_volume_now(int vol) {
+    VolumeOverlay<BufferedAudioStream<512> >::set_volume_now(vol);
+    if (vol && virtual_) Resume();
+  }
+  void set_volume_now(float vol) {
+    set_volume_now((int)(kDefaultVolume * vol));
+  }
+
+  bool isVirtual() const { return virtual_; }
+  // Restarts a virtual voice while it is still muted, so it has
+  // something buffered by the time the volume goes up. Also keeps
+  // it from going virtual for another VOICE_VIRTUALIZE_MS.
+  void Prepare() {
+    if (virtual_) {
+      Resume();
+    } else {
+      muted_samples_ = 0;
+    }
+  }
+  // Lasts until the player is handed out again, see reset_volume().
+  void set_virtualize(bool virtualize) { virtualize_ = virtualize; }
+
+  void reset_volume() {
+    VolumeOverlay<BufferedAudioStream<512> >::reset_volume();
+    virtualize_ = true;
+  }
+
   float length() const { return wav.length(); }
 
   void AddRef() { refs_++; }
@@ -65,10 +170,51 @@ public:
   bool Available() const { return refs_ == 0 && !isPlaying(); }
   uint32_t refs() const { return refs_; }
 private:
+  // Only a sound that is still playing needs to fade out, starting
+  // an idle voice shouldn't be delayed by a fade of nothing.
+  void ClearForNewSound() {
+    if (buffered()) {
+      clear_with_fade();
+    } else {
+      clear();
+    }
+  }
+
+  // Picks a virtual voice up where it would have been by now.
+  void Resume() {
+    pause_ = true;
+    float start = virtual_start_ + virtual_samples_ * (1.0f / AUDIO_RATE);
+    Effect* loop = wav.loop_effect();
+    Effect::FileID f = wav.file_id();
+    if (wav.length() > 0 && start >= wav.length()) {
+      // It would have moved on to the loop, PlayWav wraps
+      // |start| around if it has looped more than once.
+      start -= wav.length();
+      f = loop->RandomFile();
+    }
+    wav.Stop();
+    clear();
+    wav.PlayAt(f, max(start, 0.0f));
+    wav.PlayLoop(loop);
+    SetStream(&wav);
+    virtual_ = false;
+    muted_samples_ = 0;
+    scheduleFillBuffer();
+    pause_ = false;
+    Wake();
+  }
+
   uint32_t refs_ = 0;
+  volatile bool virtual_ = false;
+  bool virtualize_ = true;
+  uint32_t muted_samples_ = 0;
+  // Where the voice was when it went virtual, and how far it
+  // has gone since.
+  float virtual_start_ = 0.0f;
+  volatile uint32_t virtual_samples_ = 0;
 
   PlayWav wav;
-  volatile bool pause_;
+  volatile bool pause_ = false;
 };
 
 #endif
@@ -23,6 +23,35 @@ public:
       return;
     }
   }
+  // Same as calling advance() |n| times.
+  void advance(uint32_t n) {
+    uint32_t target = target_;
+    if (current_ > target) {
+      current_ -= min(speed_ * n, current_ - target);
+      return;
+    }
+    if (current_ < target) {
+      current_ += min(speed_ * n, target - current_);
+      return;
+    }
+  }
+  // How many of the next |n| advance() calls will change the value,
+  // and by how much each of them does (|*step|).
+  uint32_t ramp(uint32_t n, int32_t* step) const {
+    uint32_t target = target_;
+    uint32_t current = current_;
+    uint32_t diff;
+    if (current > target) {
+      diff = current - target;
+      *step = -(int32_t)speed_;
+    } else {
+      diff = target - current;
+      *step = speed_;
+    }
+    if (!diff) return 0;
+    if (!speed_) return n;
+    return min(n, (diff + speed_ - 1) / speed_);
+  }
   bool isConstant() const {
     return current_ == target_;
   }
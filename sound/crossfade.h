@@ -0,0 +1,44 @@
+#ifndef SOUND_CROSSFADE_H
+#define SOUND_CROSSFADE_H
+
+// Equal-power crossfade from one sound to another. The gains follow
+// a quarter of sin_table, so the old sound fades out with cos() and the
+// new one fades in with sin(). Unlike a linear fade, the loudness stays
+// the same in the middle of the fade, as long as the two sounds are
+// not correlated.
+// The table has 256 steps per quarter wave, plenty for fades of a
+// few milliseconds. For long fades, the gain moves in small steps.
+class Crossfade {
+public:
+  static const uint32_t kEnd = 256 << 16;
+
+  void set_length(int samples) {
+    samples = max(1, samples);
+    step_ = (kEnd + samples - 1) / samples;
+  }
+  void Start() { phase_ = 0; }
+  bool done() const { return phase_ >= kEnd; }
+  // Samples left until the fade is done.
+  int remaining() const {
+    return done() ? 0 : (kEnd - phase_ + step_ - 1) / step_;
+  }
+
+  // Replaces |out| with the next |n| samples of the fade from |out|
+  // to |in|. |n| must not be more than remaining().
+  void Apply(int16_t* out, const int16_t* in, int n) {
+    uint32_t phase = phase_;
+    for (int i = 0; i < n; i++) {
+      int idx = phase >> 16;
+      int32_t v = out[i] * sin_table[idx + 256] + in[i] * sin_table[idx];
+      out[i] = clamptoi16(v >> 14);
+      phase += step_;
+    }
+    phase_ = phase;
+  }
+
+private:
+  uint32_t step_ = kEnd;
+  volatile uint32_t phase_ = kEnd;
+};
+
+#endif
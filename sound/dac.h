@@ -6,6 +6,31 @@
 #define AUDIO_BUFFER_SIZE 44
 #define AUDIO_RATE 44100
 
+// Audio is rendered ahead of time into a FIFO of this many
+// AUDIO_BUFFER_SIZE blocks. More blocks means more tolerance for
+// other interrupts and SD reads delaying the mixing, but also
+// more latency. Boards can override this in their config file.
+// Must be a power of two.
+#ifndef AUDIO_RENDER_AHEAD_BLOCKS
+#define AUDIO_RENDER_AHEAD_BLOCKS 4
+#endif
+
+// Mixing runs in this software interrupt. It must have
+// lower priority than the DMA interrupt, but higher than
+// IRQ_WAV / PendSV, which fill the buffers that the mixer reads,
+// so that a long SD read can't hold up the mixing.
+#ifdef TEENSYDUINO
+#define IRQ_AUDIO_RENDER IRQ_SOFTWARE
+#define AUDIO_RENDER_IRQ_PRIORITY 208
+#else
+// The touch sense controller is not used, so its vector is free.
+#define IRQ_AUDIO_RENDER TSC_IRQn
+#define AUDIO_RENDER_IRQ_HANDLER TSC_IRQHandler
+// PendSV has the lowest priority (15).
+#define AUDIO_RENDER_IRQ_PRIORITY 14
+extern "C" void AUDIO_RENDER_IRQ_HANDLER(void);
+#endif
+
 #ifdef USE_I2S
 
 #ifdef TEENSYDUINO
@@ -76,6 +101,11 @@ public:
   virtual const char* name() { return "DAC"; }
   void Setup() override {
 #ifdef TEENSYDUINO
+    NVIC_SET_PRIORITY(IRQ_AUDIO_RENDER, AUDIO_RENDER_IRQ_PRIORITY);
+    _VectorsRam[IRQ_AUDIO_RENDER + 16] = &render;
+    NVIC_ENABLE_IRQ(IRQ_AUDIO_RENDER);
+    scheduleRender();
+
     dma.begin(true); // Allocate the DMA channel first
 
 #ifdef USE_I2S
@@ -158,6 +188,8 @@ public:
 
 #else  // teensyduino
     // check return value?
+    NVIC_SET_PRIORITY(IRQ_AUDIO_RENDER, AUDIO_RENDER_IRQ_PRIORITY);
+    NVIC_EnableIRQ(IRQ_AUDIO_RENDER);
     stm32l4_dma_create(&dma, DMA_CHANNEL_DMA2_CH6_SAI1_A, STM32L4_SAI_IRQ_PRIORITY);
     // NVIC_SetPriority(sai->interrupt, sai->priority);
     // NVIC_EnableIRQ(sai->interrupt);
@@ -187,6 +219,8 @@ public:
                       DMA_OPTION_PRIORITY_HIGH |
                       DMA_OPTION_CIRCULAR);
 
+    scheduleRender();
+
     SAIx->CR1 |= SAI_xCR1_DMAEN;
     if (!(SAIx->CR1 & SAI_xCR1_SAIEN))
     {
@@ -207,6 +241,12 @@ public:
       STDOUT.print(" CR2: ");
       STDOUT.println(SAIx->CR2, HEX);
 #endif      
+      STDOUT.print("Render-ahead: ");
+      STDOUT.print(render_buffer_.size());
+      STDOUT.print(" / ");
+      STDOUT.print(AUDIO_RENDER_AHEAD_BLOCKS);
+      STDOUT.print(" blocks, underruns: ");
+      STDOUT.println(underruns_);
       STDOUT.print("Current position: ");
       STDOUT.println(((uint16_t*)current_position()) - dac_dma_buffer);
       for (size_t i = 0; i < NELEM(dac_dma_buffer); i++) {
@@ -237,6 +277,37 @@ public:
     stream_ = stream;
   }
 
+  // Used by the "audio_stats" and "get_audio_stats" commands.
+  void PrintStats() {
+    STDOUT.print("DAC underruns: ");
+    STDOUT.println(underruns_);
+    STDOUT.println("DAC interrupt duration:");
+    isr_cycles_.Print("cycles");
+    STDOUT.print("DAC interrupt jitter, period is ");
+    STDOUT.print(isr_period_cycles());
+    STDOUT.println(" cycles:");
+    isr_jitter_.Print("cycles");
+    STDOUT.println("Mixing duration:");
+    render_cycles_.Print("cycles");
+  }
+  void PrintStatsMachine() {
+    STDOUT.print("DAC_UNDERRUNS=");
+    STDOUT.println(underruns_);
+    STDOUT.print("DAC_PERIOD=");
+    STDOUT.println(isr_period_cycles());
+    isr_cycles_.PrintMachine("DAC_ISR_CYCLES");
+    isr_jitter_.PrintMachine("DAC_ISR_JITTER");
+    render_cycles_.PrintMachine("DAC_RENDER_CYCLES");
+  }
+  void ClearStats() {
+    noInterrupts();
+    underruns_ = 0;
+    isr_cycles_.Clear();
+    isr_jitter_.Clear();
+    render_cycles_.Clear();
+    interrupts();
+  }
+
 private:
   static uint32_t current_position() {
 #ifdef TEENSYDUINO
@@ -245,8 +316,55 @@ private:
     return (uint32_t)(dac_dma_buffer + stm32l4_dma_count(&dma));
 #endif
   }
+
+  // Called from isr() once per block, so it only touches the
+  // NVIC when a render isn't already pending.
+  static void scheduleRender() {
+    if (render_pending_) return;
+    render_pending_ = true;
+#ifdef TEENSYDUINO
+    NVIC_SET_PENDING(IRQ_AUDIO_RENDER);
+#else
+    NVIC_SetPendingIRQ(IRQ_AUDIO_RENDER);
+#endif
+  }
+
+  // Runs the audio graph until the render-ahead FIFO is full.
+  // This function is the only producer for render_buffer_, and
+  // isr() is the only consumer.
+  static void render() {
+    ScopedCycleCounter cc(audio_render_cycles);
+    uint32_t start = GetCycleCount();
+    // Cleared before rendering, so a block freed up while we're
+    // running schedules another pass.
+    render_pending_ = false;
+    while (true) {
+      // Render all the contiguous free blocks in one go.
+      AudioBlock* blocks;
+      size_t num_blocks = render_buffer_.write_span(&blocks);
+      if (!num_blocks) break;
+      int16_t* data = blocks->data;
+      int to_read = num_blocks * AUDIO_BUFFER_SIZE;
+      AudioStream *stream = stream_;
+      int n = 0;
+      if (stream) n = stream->read(data, to_read);
+      while (n < to_read) data[n++] = 0;
+      render_buffer_.push(num_blocks);
+    }
+    render_cycles_.Add(GetCycleCount() - start);
+  }
+
+  // Nominal time between two calls to isr().
+  static uint32_t isr_period_cycles() {
+#ifdef TEENSYDUINO
+    return F_CPU / AUDIO_RATE * AUDIO_BUFFER_SIZE;
+#else
+    return SystemCoreClock / AUDIO_RATE * AUDIO_BUFFER_SIZE;
+#endif
+  }
+
   // Interrupt handler.
-  // Fills the dma buffer with new sample data.
+  // Copies one rendered block into the dma buffer.
 #ifdef TEENSYDUINO
   static void isr(void)
 #else
@@ -254,7 +372,13 @@ private:
 #endif
   {
     ScopedCycleCounter cc(audio_dma_interrupt_cycles);
-    int16_t *dest, *end;
+    uint32_t start = GetCycleCount();
+    if (last_isr_) {
+      int32_t jitter = (int32_t)(start - last_isr_ - isr_period_cycles());
+      isr_jitter_.Add(jitter < 0 ? -jitter : jitter);
+    }
+    last_isr_ = start;
+    int16_t *dest;
     uint32_t saddr = current_position();
 
 #ifdef TEENSYDUINO
@@ -264,21 +388,20 @@ private:
       // DMA is transmitting the first half of the buffer
       // so we must fill the second half
       dest = (int16_t *)&dac_dma_buffer[AUDIO_BUFFER_SIZE*CHANNELS];
-      end = (int16_t *)&dac_dma_buffer[AUDIO_BUFFER_SIZE*2*CHANNELS];
     } else {
       // DMA is transmitting the second half of the buffer
       // so we must fill the first half
       dest = (int16_t *)dac_dma_buffer;
-      end = (int16_t *)&dac_dma_buffer[AUDIO_BUFFER_SIZE*CHANNELS];
     }
-    AudioStream *stream = stream_;
-    int16_t data[AUDIO_BUFFER_SIZE];
-    int n = 0;
-    if (stream) {
-      n = stream->read(data, (end-dest) / CHANNELS);
+    static const int16_t silence[AUDIO_BUFFER_SIZE] = {};
+    const int16_t* data = silence;
+    const AudioBlock* block;
+    if (render_buffer_.read_span(&block)) {
+      data = block->data;
+    } else {
+      underruns_++;
     }
-    while (n < AUDIO_BUFFER_SIZE) data[n++] = 0;
-    for (int i = 0; i < n; i++) {
+    for (int i = 0; i < AUDIO_BUFFER_SIZE; i++) {
 #ifdef USE_I2S
 #if CHANNELS == 2
       // Duplicate sample to left and right channel.
@@ -289,13 +412,38 @@ private:
       *(dest++) = (((uint16_t*)data)[i] + 32768) >> 4;
 #endif
     }
+    if (data != silence) render_buffer_.pop(1);
+    scheduleRender();
+    isr_cycles_.Add(GetCycleCount() - start);
   }
 
   DMAMEM static uint16_t dac_dma_buffer[AUDIO_BUFFER_SIZE*2*CHANNELS];
   static AudioStream * volatile stream_;
   static DMAChannel dma;
+
+  struct AudioBlock {
+    int16_t data[AUDIO_BUFFER_SIZE];
+  };
+  static RingBuffer<AudioBlock, AUDIO_RENDER_AHEAD_BLOCKS> render_buffer_;
+  static volatile uint32_t underruns_;
+  static volatile bool render_pending_;
+
+  static Log2Histogram isr_cycles_;
+  static Log2Histogram isr_jitter_;
+  static Log2Histogram render_cycles_;
+  static volatile uint32_t last_isr_;
+
+#ifndef TEENSYDUINO
+  friend void AUDIO_RENDER_IRQ_HANDLER(void);
+#endif
 };
 
+#ifndef TEENSYDUINO
+extern "C" void AUDIO_RENDER_IRQ_HANDLER(void) {
+  LS_DAC::render();
+}
+#endif
+
 #ifdef TEENSYDUINO
 DMAChannel LS_DAC::dma(false);
 #else
@@ -303,6 +451,13 @@ DMAChannel LS_DAC::dma;
 #endif  
 AudioStream * volatile LS_DAC::stream_ = nullptr;
 DMAMEM uint16_t LS_DAC::dac_dma_buffer[AUDIO_BUFFER_SIZE*2*CHANNELS];
+RingBuffer<LS_DAC::AudioBlock, AUDIO_RENDER_AHEAD_BLOCKS> LS_DAC::render_buffer_;
+volatile uint32_t LS_DAC::underruns_ = 0;
+volatile bool LS_DAC::render_pending_ = false;
+Log2Histogram LS_DAC::isr_cycles_;
+Log2Histogram LS_DAC::isr_jitter_;
+Log2Histogram LS_DAC::render_cycles_;
+volatile uint32_t LS_DAC::last_isr_ = 0;
 
 LS_DAC dac;
 
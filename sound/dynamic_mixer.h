@@ -48,35 +48,75 @@ public:
   }
   int last_square_ = 0;
 
+  // The compressor works on sub-blocks of this many samples. Envelope
+  // and gain are updated once per sub-block, and the gain is ramped
+  // linearly across the sub-block to avoid zipper noise.
+  enum { kSubBlockShift = 3, kSubBlock = 1 << kSubBlockShift };
+
+  // Rebuild the list of active streams if any stream
+  // has called AudioStream::Wake() since last time.
+  void UpdateActiveStreams() {
+    uint32_t wake_count = AudioStream::wake_count();
+    if (wake_count == last_wake_count_) return;
+    last_wake_count_ = wake_count;
+    AudioStream** tail = &active_;
+    for (int i = 0; i < N; i++) {
+      if (streams_[i] && streams_[i]->IsActive()) {
+        *tail = streams_[i];
+        tail = &streams_[i]->next_active_;
+      }
+    }
+    *tail = nullptr;
+  }
+
+  int active_streams() const {
+    int n = 0;
+    for (AudioStream* s = active_; s; s = s->next_active_) n++;
+    return n;
+  }
+
   int read(int16_t* data, int elements) override {
-    int32_t sum[AUDIO_BUFFER_SIZE / 2];
+    int32_t sum[32];
     int ret = elements;
-    int v = 0, v2 = 0;
     num_samples_ += elements;
     while (elements) {
       int to_do = min(elements, (int)NELEM(sum));
       for (int i = 0; i < to_do; i++) sum[i] = 0;
-      for (int i = 0; i < N; i++) {
-        int e = streams_[i] ? streams_[i]->read(data, to_do) : 0;
-        for (int j = 0; j < e; j++) {
-          sum[j] += data[j];
+      UpdateActiveStreams();
+      AudioStream** prev = &active_;
+      for (AudioStream* s = active_; s; s = s->next_active_) {
+        if (!s->IsActive()) {
+          // Drop it from the list, it will be re-added by Wake().
+          *prev = s->next_active_;
+          continue;
+        }
+        prev = &s->next_active_;
+        if (s->IsMuted()) {
+          s->read(data, to_do);
+        } else {
+          s->mix(sum, data, to_do);
         }
       }
 
-      for (int i = 0; i < to_do; i++) {
-        v = sum[i];
-        vol_ = ((vol_ + abs(v)) * 255) >> 8;
-        v2 = v * volume_ / (my_sqrt(vol_) + 100);
-        data[i] = clamptoi16(v2);
-        peak_sum_ = max(abs(v), peak_sum_);
-        peak_ = max(abs(v2), peak_);
+      for (int i = 0; i < to_do; i += kSubBlock) {
+        int n = min(to_do - i, kSubBlock);
+        int32_t peak = 0;
+        int32_t abs_sum = AbsSumAndPeak(sum + i, n, &peak);
+        // Same filter as ((vol_ + abs(v)) * 255) >> 8 per sample.
+        vol_ += ((abs_sum * 255) >> 8) - ((vol_ * n) >> 8);
+        int32_t target = (volume_ << 16) / (my_sqrt(vol_) + 100);
+        int32_t delta = (target - gain_) >> kSubBlockShift;
+        int32_t start = gain_;
+        gain_ = ApplyGainRamp(sum + i, data + i, n, gain_, delta);
+        peak_sum_ = max(peak, peak_sum_);
+        peak_ = max((int32_t)(((int64_t)peak * max(start, gain_)) >> 16), peak_);
       }
       data += to_do;
       elements -= to_do;
+      last_sample_ = data[-1];
+      last_sum_ = sum[to_do - 1];
     }
-    last_sample_ = v2;
-    last_sum_ = v;
-    
+
 //    STDOUT.println(vol_);
     return ret;
   }
@@ -94,7 +134,9 @@ public:
       STDOUT.print(" peak sum: ");
       STDOUT.print(peak_sum_);
       STDOUT.print(" peak: ");
-      STDOUT.println(peak_);
+      STDOUT.print(peak_);
+      STDOUT.print(" active streams: ");
+      STDOUT.println(active_streams());
       peak_sum_ = peak_ = 0;
     }
   }
@@ -112,8 +154,13 @@ public:
   void set_volume(int32_t volume) { volume_ = volume; }
   int32_t get_volume() const { return volume_; }
 
+  // Call AudioStream::Wake() after changing this.
   AudioStream* streams_[N];
+  AudioStream* active_ = nullptr;
+  uint32_t last_wake_count_ = ~0u;
   int32_t vol_ = 0;
+  // Current gain, 16.16 fixed point.
+  int32_t gain_ = 0;
   int32_t last_sample_ = 0;
   int32_t last_sum_ = 0;
   int32_t peak_sum_ = 0;
@@ -1,6 +1,38 @@
 #ifndef SOUND_EFFECT_H
 #define SOUND_EFFECT_H
 
+#include "wav_header.h"
+
+// Number of files that we keep parsed headers for, across all effects.
+#ifndef WAV_HEADER_CACHE_SIZE
+#define WAV_HEADER_CACHE_SIZE 128
+#endif
+
+// RAM for the beginning of latency-critical sounds (see PRELOAD_EFFECT),
+// and how much of each file to keep there.
+#ifndef AUDIO_PRELOAD_BYTES
+#define AUDIO_PRELOAD_BYTES 8192
+#endif
+#ifndef AUDIO_PRELOAD_MS
+#define AUDIO_PRELOAD_MS 15
+#endif
+
+// Binary file in each font directory that remembers the parsed
+// headers and preloaded sound data, see Effect::BeginLoadIndex().
+#define FONT_INDEX_NAME "scan.idx"
+
+// RAM for keeping the index files of the presets next to the current
+// one, see Effect::Prefetch(). 0 turns prefetching off.
+#ifndef FONT_PREFETCH_BYTES
+#define FONT_PREFETCH_BYTES 0
+#endif
+
+// Max number of characters in all effect names together,
+// see Effect::BuildTrie().
+#ifndef EFFECT_TRIE_NODES
+#define EFFECT_TRIE_NODES 200
+#endif
+
 // Effect represents a set of sound files.
 // We keep track of the minimum number found, the maximum number found, weather
 // there is a file with no number, and if there are leading zeroes or not.
@@ -17,11 +49,15 @@ class Effect {
   // is to be smaller than using the filename to identify the file.
   class FileID {
    public:
-    FileID(const Effect* effect, int file) : effect_(effect), file_(file) {}
-    FileID() : effect_(nullptr), file_(0) {}
+    FileID(const Effect* effect, int file)
+      : effect_(effect), file_(file), font_(font_generation_) {}
+    FileID() : effect_(nullptr), file_(0), font_(0) {}
 
+    // IDs from before a font change never match, since the same
+    // effect and number are a different file in the new font.
     bool operator==(const FileID& other) const {
-      return other.effect_ == effect_ && file_ == other.file_;
+      return other.effect_ == effect_ && file_ == other.file_ &&
+        font_ == other.font_;
     }
 
     operator bool() const { return effect_ != nullptr; }
@@ -30,9 +66,14 @@ class Effect {
       effect_->GetName(filename, file_);
     }
 
+    const WavHeader* GetWavHeader() const {
+      return effect_->GetWavHeader(file_);
+    }
+
    private:
     const Effect* effect_;
     int file_;
+    uint32_t font_;
   };
 
   enum Extension {
@@ -49,9 +90,14 @@ class Effect {
     return UNKNOWN;
   }
 
-  Effect(const char* name) : name_(name) {
+  // If |preload| is true, the first AUDIO_PRELOAD_MS of every file
+  // is kept in RAM, so that playback can start without waiting for
+  // the SD card.
+  Effect(const char* name, bool preload = false)
+    : name_(name), preload_(preload) {
     next_ = all_effects;
     all_effects = this;
+    trie_size_ = 0;
     reset();
   }
 
@@ -63,6 +109,7 @@ class Effect {
     subdirs_ = false;
     ext_ = UNKNOWN;
     selected_ = -1;
+    headers_ = -1;
   }
 
   void Scan(const char *filename) {
@@ -164,6 +211,463 @@ class Effect {
 
   // Get the name of a specific file in the set.
   void GetName(char *filename, int n) const {
+    FileName(filename, n);
+    default_output->print("Playing ");
+    default_output->println(filename);
+  }
+
+  // Parsed header for a specific file, or nullptr if not available.
+  const WavHeader* GetWavHeader(int n) const {
+    if (headers_ < 0) return nullptr;
+    const WavHeader* h = wav_headers + headers_ + n;
+    return h->bits ? h : nullptr;
+  }
+
+  // Reserves room for the header of every file in the set,
+  // returns false if there isn't any.
+  bool AllocateHeaders() {
+    size_t n = files_found();
+    if (ext_ == UNKNOWN || !n) return false;
+    if (wav_headers_used + n > WAV_HEADER_CACHE_SIZE) return false;
+    headers_ = wav_headers_used;
+    wav_headers_used += n;
+    return true;
+  }
+
+  // Parses the header of file |n|, AllocateHeaders() must be called first.
+  void ReadHeader(int n) {
+    FileReader file;
+    char filename[128];
+    WavHeader* h = wav_headers + headers_ + n;
+    FileName(filename, n);
+    if (!file.Open(filename) || !ReadWavHeader(&file, ext_ == WAV, h)) {
+      h->bits = 0;
+      return;
+    }
+    if (preload_) Preload(&file, h);
+  }
+
+  // Parses the header of every file in the set, if there is room.
+  void ReadHeaders() {
+    if (!AllocateHeaders()) return;
+    for (size_t i = 0; i < files_found(); i++) ReadHeader(i);
+  }
+
+  static void ReadAllHeaders() {
+    wav_headers_used = 0;
+    preload_used = 0;
+    for (Effect* e = all_effects; e; e = e->next_) {
+      e->ReadHeaders();
+    }
+    PrintPreloaded();
+  }
+
+  static void PrintPreloaded() {
+    if (preload_used) {
+      STDOUT.print(" preloaded ");
+      STDOUT.print(preload_used);
+      STDOUT.print(" bytes");
+    }
+  }
+
+  // The font index saves us from opening every file in the font
+  // to read the header and preload data. FAT doesn't update directory
+  // timestamps when the files in them change, so the index is checked
+  // against a hash of all file names and sizes instead, which we
+  // get from the directory walk that ScanDirectory() does anyway.
+  // Replacing a file with a different one of the exact same size
+  // won't be noticed, delete the index to force a rescan then.
+  struct IndexHeader {
+    uint32_t magic;
+    uint32_t signature;
+    uint16_t effects;
+    uint16_t headers;
+    uint16_t preload_bytes;
+    uint16_t reserved;
+  };
+  static const uint32_t kIndexMagic = 0x31494653;  // "SFI1"
+
+  // FNV-1a
+  static uint32_t Hash(uint32_t h, const void* data, size_t len) {
+    const uint8_t* p = (const uint8_t*)data;
+    while (len--) h = (h ^ *p++) * 16777619u;
+    return h;
+  }
+
+  static uint32_t HashFile(uint32_t h, const char* name, uint32_t size) {
+    h = Hash(h, name, strlen(name) + 1);
+    return Hash(h, &size, sizeof(size));
+  }
+
+  // Anything that changes what the index contains, besides the files.
+  static uint32_t IndexSeed() {
+    uint32_t h = 2166136261u;
+    for (Effect* e = all_effects; e; e = e->next_) {
+      h = Hash(h, e->name_, strlen(e->name_) + 1);
+      h = Hash(h, &e->preload_, sizeof(e->preload_));
+    }
+    uint32_t config[] = {
+      sizeof(WavHeader), WAV_HEADER_CACHE_SIZE,
+      AUDIO_PRELOAD_BYTES, AUDIO_PRELOAD_MS,
+    };
+    return Hash(h, config, sizeof(config));
+  }
+
+  static void IndexName(char* filename) {
+    strcpy(filename, current_directory);
+    strcat(filename, FONT_INDEX_NAME);
+  }
+
+  // The index is an IndexHeader, the wav_headers offset of each effect,
+  // and then the body: the used part of wav_headers followed by the
+  // used part of preload_arena. The body is read and written in
+  // chunks of this many bytes, one chunk per ScanStep().
+  static const uint32_t kIndexChunkBytes = 512;
+
+  static uint32_t IndexBodyBytes(const IndexHeader& h) {
+    return h.headers * sizeof(WavHeader) + h.preload_bytes;
+  }
+
+  // Where the body bytes from |pos| go, at most one chunk.
+  static uint8_t* IndexChunk(const IndexHeader& h, uint32_t pos,
+                             uint32_t* len) {
+    uint32_t header_bytes = h.headers * sizeof(WavHeader);
+    uint8_t* p;
+    if (pos < header_bytes) {
+      p = (uint8_t*)wav_headers + pos;
+      *len = header_bytes - pos;
+    } else {
+      p = preload_arena + pos - header_bytes;
+      *len = IndexBodyBytes(h) - pos;
+    }
+    if (*len > kIndexChunkBytes) *len = kIndexChunkBytes;
+    return p;
+  }
+
+  // Reads and checks the IndexHeader and the effect offsets.
+  static bool ReadIndexHeader(FileReader* f, uint32_t signature) {
+    IndexHeader& header = index_header_;
+    if (f->Read((uint8_t*)&header, sizeof(header)) != sizeof(header) ||
+        header.magic != kIndexMagic || header.signature != signature ||
+        header.headers > WAV_HEADER_CACHE_SIZE ||
+        header.preload_bytes > AUDIO_PRELOAD_BYTES) {
+      return false;
+    }
+    int n = 0;
+    for (Effect* e = all_effects; e; e = e->next_) n++;
+    if (header.effects != n || n > (int)NELEM(index_offsets_)) return false;
+    return f->Read((uint8_t*)index_offsets_, n * 2) == n * 2;
+  }
+
+  // Called when the whole body has been read.
+  static void UseIndex() {
+    int n = 0;
+    for (Effect* e = all_effects; e; e = e->next_) {
+      e->headers_ = index_offsets_[n++];
+    }
+    wav_headers_used = index_header_.headers;
+    preload_used = index_header_.preload_bytes;
+    STDOUT.print(" from index");
+  }
+
+  // Loads a whole index in one go, for indexes that are already in RAM.
+  static bool LoadIndex(FileReader* f, uint32_t signature) {
+    if (!ReadIndexHeader(f, signature)) return false;
+    uint32_t bytes = IndexBodyBytes(index_header_);
+    for (uint32_t pos = 0; pos < bytes;) {
+      uint32_t len;
+      uint8_t* p = IndexChunk(index_header_, pos, &len);
+      if (f->Read(p, len) != (int)len) return false;
+      pos += len;
+    }
+    UseIndex();
+    return true;
+  }
+
+#ifdef ENABLE_SD
+  // Opens the index for current_directory, returns false if there
+  // isn't a usable one. LoadIndexStep() reads the rest.
+  static bool BeginLoadIndex(uint32_t signature) {
+    char filename[128];
+    IndexName(filename);
+    if (!index_reader_.Open(filename)) return false;
+    if (!ReadIndexHeader(&index_reader_, signature)) {
+      index_reader_.Close();
+      return false;
+    }
+    index_pos_ = 0;
+    return true;
+  }
+
+  // Reads one chunk. Returns 1 if there is more to read, 0 when the
+  // index has been loaded and -1 if it couldn't be read.
+  static int LoadIndexStep() {
+    uint32_t bytes = IndexBodyBytes(index_header_);
+    if (index_pos_ < bytes) {
+      uint32_t len;
+      uint8_t* p = IndexChunk(index_header_, index_pos_, &len);
+      if (index_reader_.Read(p, len) != (int)len) {
+        index_reader_.Close();
+        return -1;
+      }
+      index_pos_ += len;
+      if (index_pos_ < bytes) return 1;
+    }
+    index_reader_.Close();
+    UseIndex();
+    return 0;
+  }
+
+  // Starts writing the index for current_directory. The header is
+  // written last, so an index that was cut short is never used.
+  static bool BeginSaveIndex(uint32_t signature) {
+    char filename[128];
+    IndexName(filename);
+    LSFS::Remove(filename);
+    index_writer_ = LSFS::OpenForWrite(filename);
+    if (!index_writer_) return false;
+    IndexHeader& header = index_header_;
+    header = IndexHeader();
+    header.signature = signature;
+    header.headers = wav_headers_used;
+    header.preload_bytes = preload_used;
+    for (Effect* e = all_effects; e; e = e->next_) header.effects++;
+    index_writer_.write((const uint8_t*)&header, sizeof(header));
+    for (Effect* e = all_effects; e; e = e->next_) {
+      int16_t offset = e->headers_;
+      index_writer_.write((const uint8_t*)&offset, sizeof(offset));
+    }
+    index_pos_ = 0;
+    return true;
+  }
+
+  // Writes one chunk. Returns false when done.
+  static bool SaveIndexStep() {
+    uint32_t bytes = IndexBodyBytes(index_header_);
+    if (index_pos_ < bytes) {
+      uint32_t len;
+      const uint8_t* p = IndexChunk(index_header_, index_pos_, &len);
+      index_writer_.write(p, len);
+      index_pos_ += len;
+      return true;
+    }
+    index_header_.magic = kIndexMagic;
+    index_writer_.seek(0);
+    index_writer_.write((const uint8_t*)&index_header_, sizeof(index_header_));
+    index_writer_.close();
+    return false;
+  }
+
+  // Closes any index file left open by a scan that was cut short.
+  static void AbortIndex() {
+    index_reader_.Close();
+    if (index_writer_) index_writer_.close();
+  }
+
+  static FileReader index_reader_;
+  static File index_writer_;
+#else
+  static bool BeginLoadIndex(uint32_t signature) { return false; }
+  static int LoadIndexStep() { return -1; }
+  static bool BeginSaveIndex(uint32_t signature) { return false; }
+  static bool SaveIndexStep() { return false; }
+  static void AbortIndex() {}
+#endif
+  static IndexHeader index_header_;
+  static int16_t index_offsets_[64];
+  // Body bytes read or written so far.
+  static uint32_t index_pos_;
+
+#if defined(ENABLE_SD) && FONT_PREFETCH_BYTES > 0
+  // Copies of the index files of the fonts we are likely to switch to
+  // next, so that switching to them doesn't wait for the SD card.
+  // An index that doesn't fit in its half of FONT_PREFETCH_BYTES is
+  // not kept.
+  struct PrefetchSlot {
+    char directory[64];  // With a trailing slash, like current_directory.
+    uint32_t signature;
+    uint32_t bytes;      // Size of the index, 0 if there is none to keep.
+    uint32_t fetched;
+  };
+  class DirectoryWalk;
+  static const int kPrefetchSlots = 2;
+  static const uint32_t kPrefetchSlotBytes = FONT_PREFETCH_BYTES / kPrefetchSlots;
+
+  // Fetches the index for fonts |a| and |b|, a little at a time.
+  // Call it when there is nothing better to do. Returns false when
+  // both are done.
+  static bool Prefetch(const char* a, const char* b) {
+    if (prefetch_slot_ != -1) {
+      PrefetchStep();
+      return true;
+    }
+    const char* want[kPrefetchSlots] = { a, b };
+    int have[kPrefetchSlots];
+    for (int i = 0; i < kPrefetchSlots; i++) {
+      have[i] = want[i] ? FindPrefetched(want[i]) : -1;
+    }
+    for (int i = 0; i < kPrefetchSlots; i++) {
+      if (!want[i] || have[i] != -1) continue;
+      for (int slot = 0; slot < kPrefetchSlots; slot++) {
+        if (have[0] != slot && have[1] != slot) {
+          BeginPrefetch(slot, want[i]);
+          return true;
+        }
+      }
+    }
+    return false;
+  }
+
+  static uint32_t prefetch_hits() { return prefetch_hits_; }
+  static uint32_t prefetch_misses() { return prefetch_misses_; }
+
+  static void PrintPrefetchStats() {
+    STDOUT.print("Prefetch hits: ");
+    STDOUT.print(prefetch_hits_);
+    STDOUT.print(" misses: ");
+    STDOUT.println(prefetch_misses_);
+    for (int i = 0; i < kPrefetchSlots; i++) {
+      const PrefetchSlot& slot = prefetch_slots_[i];
+      if (!slot.directory[0]) continue;
+      STDOUT.print(" ");
+      STDOUT.print(slot.directory);
+      STDOUT.print(" ");
+      STDOUT.print(slot.fetched);
+      STDOUT.print("/");
+      STDOUT.println(slot.bytes);
+    }
+  }
+
+private:
+  static void SlotDirectory(char* out, const char* directory) {
+    strcpy(out, directory);
+    if (strlen(out) && out[strlen(out) - 1] != '/') strcat(out, "/");
+  }
+
+  static int FindPrefetched(const char* directory) {
+    char dir[sizeof(PrefetchSlot::directory)];
+    SlotDirectory(dir, directory);
+    for (int i = 0; i < kPrefetchSlots; i++) {
+      if (!strcmp(prefetch_slots_[i].directory, dir)) return i;
+    }
+    return -1;
+  }
+
+  static void BeginPrefetch(int slot, const char* directory) {
+    PrefetchSlot& s = prefetch_slots_[slot];
+    s.bytes = s.fetched = 0;
+    if (strlen(directory) + 2 > sizeof(s.directory)) {
+      s.directory[0] = 0;
+      return;
+    }
+    SlotDirectory(s.directory, directory);
+    LOCK_SD(true);
+    if (prefetch_walk_.Begin(directory, false)) prefetch_slot_ = slot;
+    LOCK_SD(false);
+  }
+
+  // Walks the directory one entry per step, like ScanStep(), then
+  // reads the index 512 bytes per step.
+  static void PrefetchStep() {
+    PrefetchSlot& s = prefetch_slots_[prefetch_slot_];
+    if (prefetch_walk_.walking()) {
+      LOCK_SD(true);
+      bool more = prefetch_walk_.Step();
+      if (!more) {
+        s.signature = prefetch_walk_.signature();
+        char filename[128];
+        strcpy(filename, s.directory);
+        strcat(filename, FONT_INDEX_NAME);
+        if (prefetch_file_.Open(filename)) {
+          if (prefetch_file_.FileSize() <= kPrefetchSlotBytes) {
+            s.bytes = prefetch_file_.FileSize();
+          } else {
+            prefetch_file_.Close();
+          }
+        }
+      }
+      LOCK_SD(false);
+      if (!more && !s.bytes) prefetch_slot_ = -1;
+      return;
+    }
+    uint8_t* data = prefetch_data_ + prefetch_slot_ * kPrefetchSlotBytes;
+    int n = min(s.bytes - s.fetched, 512u);
+    LOCK_SD(true);
+    if (prefetch_file_.Read(data + s.fetched, n) != n) n = -1;
+    LOCK_SD(false);
+    if (n < 0) {
+      s.bytes = 0;
+    } else {
+      s.fetched += n;
+    }
+    if (s.fetched < s.bytes) return;
+    prefetch_file_.Close();
+    prefetch_slot_ = -1;
+    const IndexHeader* header = (const IndexHeader*)data;
+    if (s.bytes < sizeof(IndexHeader) || header->magic != kIndexMagic ||
+        header->signature != s.signature) {
+      // No point keeping an index that is out of date.
+      s.bytes = s.fetched = 0;
+    }
+  }
+
+  // Loads the index for current_directory from RAM, if we have it.
+  static bool LoadPrefetched(uint32_t signature) {
+    int slot = FindPrefetched(current_directory);
+    PrefetchSlot* s = slot == -1 ? nullptr : prefetch_slots_ + slot;
+    if (!s || !s->bytes || s->fetched != s->bytes ||
+        s->signature != signature) {
+      prefetch_misses_++;
+      return false;
+    }
+    FileReader f;
+    f.OpenMem(prefetch_data_ + slot * kPrefetchSlotBytes, s->bytes);
+    if (!LoadIndex(&f, signature)) {
+      prefetch_misses_++;
+      return false;
+    }
+    STDOUT.print(" (prefetched)");
+    prefetch_hits_++;
+    return true;
+  }
+
+  static PrefetchSlot prefetch_slots_[kPrefetchSlots];
+  static uint8_t prefetch_data_[FONT_PREFETCH_BYTES];
+  static FileReader prefetch_file_;
+  static DirectoryWalk prefetch_walk_;
+  // Slot being fetched, or -1.
+  static int prefetch_slot_;
+  static uint32_t prefetch_hits_;
+  static uint32_t prefetch_misses_;
+
+public:
+#else
+  static bool Prefetch(const char* a, const char* b) { return false; }
+  static bool LoadPrefetched(uint32_t signature) { return false; }
+  static void PrintPrefetchStats() {
+    STDOUT.println("Prefetching is off, see FONT_PREFETCH_BYTES.");
+  }
+#endif
+
+  static_assert(AUDIO_PRELOAD_BYTES <= 65535, "preload offsets are 16 bits");
+  static uint8_t preload_arena[AUDIO_PRELOAD_BYTES];
+
+private:
+  // |file| must be at the start of the sample data.
+  static void Preload(FileReader* file, WavHeader* h) {
+    uint32_t frame = h->frame_bytes();
+    uint32_t bytes = h->rate * h->channels * h->bits / 8 *
+      AUDIO_PRELOAD_MS / 1000;
+    bytes = min(bytes, h->data_bytes);
+    bytes -= bytes % frame;
+    if (!bytes || preload_used + bytes > AUDIO_PRELOAD_BYTES) return;
+    if (file->Read(preload_arena + preload_used, bytes) != (int)bytes) return;
+    h->preload_offset = preload_used;
+    h->preload_bytes = bytes;
+    preload_used += bytes;
+  }
+
+  void FileName(char *filename, int n) const {
     strcpy(filename, current_directory);
     strcat(filename, name_);
     if (subdirs_) {
@@ -191,11 +695,10 @@ class Effect {
       case USL: strcat(filename, ".usl"); break;
       default: break;
     }
-    
-    default_output->print("Playing ");
-    default_output->println(filename);
   }
 
+public:
+
   static void ScanAll(const char* filename) {
     if (Effect::IdentifyExtension(filename) == Effect::UNKNOWN) {
       return;
@@ -206,87 +709,288 @@ class Effect {
     STDOUT.print("SCAN ");
     STDOUT.println(filename);
 #endif
-    for (Effect* e = all_effects; e; e = e->next_) {
-      e->Scan(filename);
+    if (!trie_size_) BuildTrie();
+    if (trie_size_ < 0) {
+      // The effect names didn't fit in the trie.
+      for (Effect* e = all_effects; e; e = e->next_) {
+        e->Scan(filename);
+      }
+      return;
+    }
+    // Every effect whose name is a prefix of filename gets to look at
+    // it, Scan() decides if it's really a match. ("lock" is a prefix
+    // of "lockup01.wav", but it's not one of the lock files.)
+    int node = 0;
+    for (const char* p = filename; *p; p++) {
+      char c = toLower(*p);
+      for (node = trie_[node].child; node; node = trie_[node].sibling) {
+        if (trie_[node].c == c) break;
+      }
+      if (!node) return;
+      if (trie_[node].effect) trie_[node].effect->Scan(filename);
     }
   }
 
-  static void ScanDirectory(const char *directory) {
-    STDOUT.print("Scanning sound font: ");
-    STDOUT.print(directory);
+  // Puts all effect names in a prefix trie. Node 0 is the root,
+  // and 0 also means "no node" in child and sibling, since the root
+  // can't be anybody's child or sibling.
+  static void BuildTrie() {
+    trie_[0] = TrieNode();
+    trie_size_ = 1;
     for (Effect* e = all_effects; e; e = e->next_) {
-      e->reset();
+      int node = 0;
+      for (const char* p = e->name_; *p; p++) {
+        char c = toLower(*p);
+        int child;
+        for (child = trie_[node].child; child; child = trie_[child].sibling) {
+          if (trie_[child].c == c) break;
+        }
+        if (!child) {
+          if (trie_size_ == EFFECT_TRIE_NODES) {
+            trie_size_ = -1;
+            return;
+          }
+          child = trie_size_++;
+          trie_[child] = TrieNode();
+          trie_[child].c = c;
+          trie_[child].sibling = trie_[node].child;
+          trie_[node].child = child;
+        }
+        node = child;
+      }
+      if (trie_[node].effect) {
+        // Two effects with the same name.
+        trie_size_ = -1;
+        return;
+      }
+      trie_[node].effect = e;
     }
+  }
+
+  // Walks the font directory and hashes all the file names and sizes
+  // in it, for checking the index. If |scan| is true, also finds the
+  // files for each effect. Step() handles one directory entry, so
+  // that the walk can be spread out over several loop iterations.
+  class DirectoryWalk {
+  public:
+    ~DirectoryWalk() { End(); }
+
+    // Returns false if there is no such directory.
+    bool Begin(const char* directory, bool scan) {
+      End();
+      bool found = false;
+      scan_ = scan;
+      signature_ = IndexSeed();
 
 #ifdef ENABLE_SERIALFLASH
-    // Scan serial flash.
-    SerialFlashChip::opendir();
-    uint32_t size;
-    char filename[128];
-    while (SerialFlashChip::readdir(filename, sizeof(filename), size)) {
-      const char* f = startswith(directory, filename);
-      if (f) ScanAll(f);
-    }
+      // Scan serial flash, it's quick.
+      SerialFlashChip::opendir();
+      uint32_t size;
+      char filename[128];
+      while (SerialFlashChip::readdir(filename, sizeof(filename), size)) {
+        const char* f = startswith(directory, filename);
+        if (f) {
+          if (scan_) ScanAll(f);
+          signature_ = HashFile(signature_, f, size);
+        }
+      }
 #endif
 
 #ifdef ENABLE_SD
+      if (LSFS::Exists(directory)) {
+        dir_ = new LSFS::Iterator(directory);
+        found = true;
+      }
+#endif
+      return found;
+    }
 
-#if 1
-    if (LSFS::Exists(directory)) {
-      for (LSFS::Iterator iter(directory); iter; ++iter) {
-        if (iter.isdir()) {
+    // Returns false when there is nothing left to walk.
+    bool Step() {
+#ifdef ENABLE_SD
+      if (!dir_) return false;
+      if (subdir_) {
+        if (*subdir_) {
           char fname[128];
-          strcpy(fname, iter.name());
+          strcpy(fname, dir_->name());
           strcat(fname, "/");
-          char* fend = fname + strlen(fname);
-          for (LSFS::Iterator i2(iter); i2; ++i2) {
-            strcpy(fend, i2.name());
-            ScanAll(fname);
-          }
-        } else {
-          ScanAll(iter.name());
+          strcat(fname, subdir_->name());
+          if (scan_) ScanAll(fname);
+          signature_ = HashFile(signature_, fname, subdir_->size());
+          ++*subdir_;
+          return true;
         }
+        delete subdir_;
+        subdir_ = nullptr;
+        ++*dir_;
+        return true;
+      }
+      if (!*dir_) {
+        End();
+        return false;
+      }
+      if (dir_->isdir()) {
+        subdir_ = new LSFS::Iterator(*dir_);
+        return true;
       }
+      if (scan_) ScanAll(dir_->name());
+      if (strcasecmp(dir_->name(), FONT_INDEX_NAME))
+        signature_ = HashFile(signature_, dir_->name(), dir_->size());
+      ++*dir_;
+      return true;
+#else
+      return false;
+#endif
     }
+
+    bool walking() const {
+#ifdef ENABLE_SD
+      return dir_ != nullptr;
 #else
-    if (SD.exists(directory)) {
-      File dir = SD.open(directory);
-      if (dir) {
-        while (File f = dir.openNextFile()) {
-          if (f.isDirectory()) {
-            char fname[128];
-            strcpy(fname, f.name());
-            strcat(fname, "/");
-            char* fend = fname + strlen(fname);
-            while (File f2 = f.openNextFile()) {
-              strcpy(fend, f2.name());
-              ScanAll(fname);
-              f2.close();
-            }
-          } else {
-            ScanAll(f.name());
-          }
-          f.close();
-        }
-        dir.close();
+      return false;
+#endif
+    }
+    uint32_t signature() const { return signature_; }
+
+  private:
+    void End() {
+#ifdef ENABLE_SD
+      delete subdir_;
+      subdir_ = nullptr;
+      delete dir_;
+      dir_ = nullptr;
+#endif
+    }
+
+    bool scan_ = false;
+    uint32_t signature_ = 0;
+#ifdef ENABLE_SD
+    LSFS::Iterator* dir_ = nullptr;
+    LSFS::Iterator* subdir_ = nullptr;
+#endif
+  };
+
+  // Returns false if there is no such directory.
+  static bool WalkDirectory(const char* directory, bool scan,
+                            uint32_t* signature) {
+    DirectoryWalk walk;
+    bool found = walk.Begin(directory, scan);
+    while (walk.Step());
+    *signature = walk.signature();
+    return found;
+  }
+
+  // Finds the files in the font. This only reads directories, which
+  // is quick; opening the files to read their headers is what takes
+  // time, see ScanStep(). The directory walk is still done in one go
+  // on every font change, even when there is an index, since the
+  // signature that tells us if the index is current comes from it.
+  static void BeginScan(const char *directory) {
+    STDOUT.print("Scanning sound font: ");
+    STDOUT.print(directory);
+    for (Effect* e = all_effects; e; e = e->next_) {
+      e->reset();
+    }
+    font_generation_++;
+    LOCK_SD(true);
+    scan_use_index_ = WalkDirectory(directory, true, &scan_signature_);
+    AbortIndex();
+    LOCK_SD(false);
+#if defined(ENABLE_SD) && defined(ENABLE_AUDIO)
+    if (!scan_use_index_) {
+      if (strlen(directory) > 8) {
+        talkie.Say(talkie_font_directory_15, 15);
+        talkie.Say(talkie_too_long_15, 15);
+      } else if (strlen(directory)) {
+        talkie.Say(talkie_font_directory_15, 15);
+        talkie.Say(talkie_not_found_15, 15);
       }
     }
 #endif
-    
-#ifdef ENABLE_AUDIO
-    else if (strlen(directory) > 8) {
-      talkie.Say(talkie_font_directory_15, 15);
-      talkie.Say(talkie_too_long_15, 15);
-    } else if (strlen(directory)) {
-      talkie.Say(talkie_font_directory_15, 15);
-      talkie.Say(talkie_not_found_15, 15);
-    }
-#endif   // ENABLE_AUDIO    
-#endif   // ENABLE_SD
-    STDOUT.println(" done");
+    index_state_ = INDEX_NONE;
+    scan_effect_ = all_effects;
+    scan_file_ = -1;
+    scanning_ = true;
+  }
+
+  // Does a little more of the scan that BeginScan() started: opens at
+  // most one file, or reads or writes one chunk of the index. Returns
+  // false when the font is ready. This lets the main loop keep the
+  // blades going while a new font loads. Audio streams don't touch
+  // the SD card while a step runs.
+  static bool ScanStep() {
+    if (!scanning_) return false;
+    LOCK_SD(true);
+    bool more = DoScanStep();
+    LOCK_SD(false);
+    return more;
+  }
+
+  static void ScanDirectory(const char *directory) {
+    BeginScan(directory);
+    while (ScanStep());
   }
 
 private:
+  static bool DoScanStep() {
+    switch (index_state_) {
+      case INDEX_NONE:
+        break;
+      case INDEX_READING:
+        switch (LoadIndexStep()) {
+          case 1: return true;
+          case 0: return EndScan();
+        }
+        // Couldn't read it after all, scan the files instead.
+        index_state_ = INDEX_NONE;
+        wav_headers_used = 0;
+        preload_used = 0;
+        scan_file_ = 0;
+        return true;
+      case INDEX_WRITING:
+        if (SaveIndexStep()) return true;
+        return EndScan();
+    }
+    if (scan_file_ == -1) {
+      if (scan_use_index_) {
+        if (LoadPrefetched(scan_signature_)) return EndScan();
+        if (BeginLoadIndex(scan_signature_)) {
+          index_state_ = INDEX_READING;
+          return true;
+        }
+      }
+      wav_headers_used = 0;
+      preload_used = 0;
+      scan_file_ = 0;
+      // Looking for the index took this step.
+      if (scan_use_index_) return true;
+    }
+    while (scan_effect_) {
+      Effect* e = scan_effect_;
+      int files = e->files_found();
+      if (scan_file_ == 0 && !e->AllocateHeaders()) scan_file_ = files;
+      if (scan_file_ < files) {
+        e->ReadHeader(scan_file_++);
+        return true;
+      }
+      scan_effect_ = e->next_;
+      scan_file_ = 0;
+    }
+    PrintPreloaded();
+    if (scan_use_index_ && BeginSaveIndex(scan_signature_)) {
+      index_state_ = INDEX_WRITING;
+      return true;
+    }
+    return EndScan();
+  }
+
+  static bool EndScan() {
+    scanning_ = false;
+    index_state_ = INDEX_NONE;
+    STDOUT.println(" done");
+    return false;
+  }
+
   Effect* next_;
 
   // Minimum file number.
@@ -312,6 +1016,77 @@ private:
 
   // All files must end with this extension.
   Extension ext_;
+
+  // Index of our first entry in wav_headers, or -1.
+  int headers_;
+
+  // Keep the start of each file in preload_arena.
+  bool preload_;
+
+  static WavHeader wav_headers[WAV_HEADER_CACHE_SIZE];
+  static size_t wav_headers_used;
+  static size_t preload_used;
+
+  struct TrieNode {
+    char c = 0;
+    uint8_t child = 0;
+    uint8_t sibling = 0;
+    // Effect with the name that ends here, if any.
+    Effect* effect = nullptr;
+  };
+  static_assert(EFFECT_TRIE_NODES <= 256, "trie indices are 8 bits");
+  static TrieNode trie_[EFFECT_TRIE_NODES];
+  // Number of nodes used, 0 if the trie needs to be rebuilt,
+  // -1 if the effect names didn't fit.
+  static int trie_size_;
+
+  // Bumped every time a font is scanned, see FileID.
+  static uint32_t font_generation_;
+
+  // State for BeginScan() / ScanStep().
+  static bool scanning_;
+  static bool scan_use_index_;
+  static uint32_t scan_signature_;
+  // Next effect and file to read the header of, scan_file_ is -1
+  // until we've tried the index.
+  static Effect* scan_effect_;
+  static int scan_file_;
+  enum IndexState {
+    INDEX_NONE,
+    INDEX_READING,
+    INDEX_WRITING,
+  };
+  static IndexState index_state_;
 };
 
+WavHeader Effect::wav_headers[WAV_HEADER_CACHE_SIZE];
+size_t Effect::wav_headers_used = 0;
+uint8_t Effect::preload_arena[AUDIO_PRELOAD_BYTES] __attribute__((aligned(4)));
+size_t Effect::preload_used = 0;
+Effect::TrieNode Effect::trie_[EFFECT_TRIE_NODES];
+int Effect::trie_size_ = 0;
+uint32_t Effect::font_generation_ = 0;
+bool Effect::scanning_ = false;
+bool Effect::scan_use_index_ = false;
+uint32_t Effect::scan_signature_ = 0;
+Effect* Effect::scan_effect_ = nullptr;
+int Effect::scan_file_ = 0;
+Effect::IndexState Effect::index_state_ = Effect::INDEX_NONE;
+Effect::IndexHeader Effect::index_header_;
+int16_t Effect::index_offsets_[64];
+uint32_t Effect::index_pos_ = 0;
+#ifdef ENABLE_SD
+FileReader Effect::index_reader_;
+File Effect::index_writer_;
+#endif
+#if defined(ENABLE_SD) && FONT_PREFETCH_BYTES > 0
+Effect::PrefetchSlot Effect::prefetch_slots_[Effect::kPrefetchSlots];
+uint8_t Effect::prefetch_data_[FONT_PREFETCH_BYTES] __attribute__((aligned(4)));
+FileReader Effect::prefetch_file_;
+Effect::DirectoryWalk Effect::prefetch_walk_;
+int Effect::prefetch_slot_ = -1;
+uint32_t Effect::prefetch_hits_ = 0;
+uint32_t Effect::prefetch_misses_ = 0;
+#endif
+
 #endif
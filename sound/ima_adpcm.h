@@ -0,0 +1,53 @@
+#ifndef SOUND_IMA_ADPCM_H
+#define SOUND_IMA_ADPCM_H
+
+// IMA ADPCM, as stored in wav files with format tag 0x11.
+// Each 4-bit code is a delta from the previous sample, scaled by a
+// step size which adapts from one code to the next. Files are made
+// of blocks, each one starting with the first sample and step index
+// for every channel, so decoding can restart at any block.
+
+const int16_t ima_adpcm_steps[89] = {
+  7,8,9,10,11,12,13,14,16,17,19,21,23,25,28,31,34,37,41,45,50,55,60,
+  66,73,80,88,97,107,118,130,143,157,173,190,209,230,253,279,307,337,
+  371,408,449,494,544,598,658,724,796,876,963,1060,1166,1282,1411,
+  1552,1707,1878,2066,2272,2499,2749,3024,3327,3660,4026,4428,4871,
+  5358,5894,6484,7132,7845,8630,9493,10442,11487,12635,13899,15289,
+  16818,18500,20350,22385,24623,27086,29794,32767
+};
+
+const int8_t ima_adpcm_index[8] = { -1, -1, -1, -1, 2, 4, 6, 8 };
+
+// Decoder state for one channel.
+class ImaAdpcmChannel {
+public:
+  // Reads a 4 byte block header, returns the first sample.
+  int16_t Start(const unsigned char* header) {
+    predictor_ = (int16_t)(header[0] | (header[1] << 8));
+    index_ = min((int)header[2], 88);
+    return predictor_;
+  }
+
+  int16_t Decode(int code) {
+    int step = ima_adpcm_steps[index_];
+    int diff = step >> 3;
+    if (code & 1) diff += step >> 2;
+    if (code & 2) diff += step >> 1;
+    if (code & 4) diff += step;
+    if (code & 8) diff = -diff;
+    predictor_ = clamptoi16(predictor_ + diff);
+    index_ += ima_adpcm_index[code & 7];
+    if (index_ < 0) index_ = 0;
+    if (index_ > 88) index_ = 88;
+    return predictor_;
+  }
+
+  int16_t predictor() const { return predictor_; }
+  int index() const { return index_; }
+
+private:
+  int32_t predictor_ = 0;
+  int index_ = 0;
+};
+
+#endif
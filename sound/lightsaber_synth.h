@@ -7,6 +7,9 @@ public:
 
 //  WaveForm sin_a_;
 //  WaveForm sin_b_;
+  // 32768 / (3 + sin(x)), scaled like the old per-sample division,
+  // so the oscillators that modulate the others don't need one.
+  WaveForm modulation_;
   WaveForm buzz_;
   WaveForm humm_;
   WaveFormSampler sin_sampler_a_hi_;
@@ -36,19 +39,22 @@ public:
   }
 
   LightSaberSynth() :
-    sin_sampler_a_hi_(sin_table),
-    sin_sampler_a_lo_(sin_table),
-    sin_sampler_b_(sin_table),
+    sin_sampler_a_hi_(modulation_),
+    sin_sampler_a_lo_(modulation_),
+    sin_sampler_b_(modulation_),
     buzz_sampler_(buzz_),
     humm_sampler_hi_(humm_),
     humm_sampler_lo_(humm_),
     volume_(32768 / 100) {
-    sin_sampler_a_hi_.delta_ = 137 * 65536 / AUDIO_RATE;
-    sin_sampler_a_lo_.delta_ = 1024 * 65536 / AUDIO_RATE;
-    sin_sampler_b_.delta_ = 300 * 65536 / AUDIO_RATE;
+    sin_sampler_a_hi_.delta_ = WaveFormSampler::Delta(137 / 1024.0);
+    sin_sampler_a_lo_.delta_ = WaveFormSampler::Delta(1024 / 1024.0);
+    sin_sampler_b_.delta_ = WaveFormSampler::Delta(300 / 1024.0);
     AdjustDelta(0.0);
+    volume_.set(0);
+    volume_.set_target(0);
     for (int i = 0; i < 1024; i++) {
       float f = i/1024.0;
+      modulation_.table_[i] = 32768 * 16383 / (3 * 16383 + sin_table[i]);
 //      sin_a_.table_[i] = 32768 / (3 + si(f));
 //      sin_b_.table_[i] = 32766 / (3 + si(f));
       buzz_.table_[i] = 32766 * buzz(f);
@@ -58,30 +64,40 @@ public:
 
   void AdjustDelta(float speed) {
     float cents = 1.0 - 0.5 * clamp(speed/200.0, -1.0, 1.0);
-    float hz_to_delta = cents * 1024 * 65536 / AUDIO_RATE;
-    buzz_sampler_.delta_ = 35 * hz_to_delta;
-    humm_sampler_lo_.delta_ = 90 * hz_to_delta;
-    humm_sampler_hi_.delta_ = 98 * hz_to_delta;
+    buzz_sampler_.delta_ = WaveFormSampler::Delta(35 * cents);
+    humm_sampler_lo_.delta_ = WaveFormSampler::Delta(90 * cents);
+    humm_sampler_hi_.delta_ = WaveFormSampler::Delta(98 * cents);
   }
 
+  // Runs each oscillator over a block at a time, then mixes.
   int read(int16_t *data, int elements) override {
     last_elements = elements;
-    for (int i = 0; i < elements; i++) {
-      int32_t tmp;
-      tmp  = humm_sampler_lo_.next() *
-        (32768 * 16383 / (3 * 16383 + sin_sampler_a_lo_.next()));
-      tmp += humm_sampler_hi_.next() *
-        (32768 * 16383 / (3 * 16383 + sin_sampler_a_hi_.next()));
-      tmp += buzz_sampler_.next() *
-        (32768 * 16383 / (3 * 16383 + sin_sampler_b_.next()));
-      tmp >>= 15;
-//      tmp = humm_sampler_lo_.next();
+    volume_.set_target(on_ ? 32768 : 0);
+    for (int done = 0; done < elements;) {
+      int16_t a_lo[32], a_hi[32], b[32];
+      int16_t humm_lo[32], humm_hi[32], buzz[32];
+      int n = min(elements - done, (int)NELEM(a_lo));
+      sin_sampler_a_lo_.Render(a_lo, n);
+      sin_sampler_a_hi_.Render(a_hi, n);
+      sin_sampler_b_.Render(b, n);
+      humm_sampler_lo_.Render(humm_lo, n);
+      humm_sampler_hi_.Render(humm_hi, n);
+      buzz_sampler_.Render(buzz, n);
+      int32_t step;
+      int ramp = volume_.ramp(n, &step);
+      int32_t vol = volume_.value();
+      int16_t* out = data + done;
+      int32_t tmp = 0;
+      for (int i = 0; i < n; i++) {
+        tmp = humm_lo[i] * a_lo[i] + humm_hi[i] * a_hi[i] + buzz[i] * b[i];
+        tmp >>= 15;
+        out[i] = clamptoi16((tmp * vol) >> 15);
+        if (i < ramp) vol += step;
+      }
+      volume_.advance(ramp);
       last_prevolume_value = tmp;
-      tmp = (tmp * (int32_t)volume_.value()) >> 15;
-      volume_.advance();
-      tmp = clamptoi16(tmp);
-      last_value = tmp;
-      data[i] = tmp;
+      last_value = out[n - 1];
+      done += n;
     }
     return elements;
   }
@@ -28,8 +28,11 @@ public:
   void SB_On() override {
     // Starts hum, etc.
     delegate_->SB_On();
+    // The swing volumes follow the gyro, there is no threshold to
+    // call Prepare() ahead of, so these players never go virtual.
     low_ = GetFreeWavPlayer();
     if (low_) {
+      low_->set_virtualize(false);
       low_->set_volume_now(0);
       low_->PlayOnce(&swingl);
       low_->PlayLoop(&swingl);
@@ -38,6 +41,7 @@ public:
     }
     high_ = GetFreeWavPlayer();
     if (high_) {
+      high_->set_virtualize(false);
       high_->set_volume_now(0);
       high_->PlayOnce(&swingh);
       high_->PlayLoop(&swingh);
@@ -4,6 +4,9 @@
 #include "../common/file_reader.h"
 #include "../common/state_machine.h"
 #include "audiostream.h"
+#include "resampler.h"
+#include "ima_adpcm.h"
+#include "wav_header.h"
 
 // Simple upsampler code, doubles the number of samples with
 // 2-lobe lanczos upsampling.
@@ -42,23 +45,6 @@
   }
 #endif
 
-#define DOWNSAMPLE_FUNC(NAME, EMIT)                     \
-  void NAME(int16_t sample) {                           \
-    if (downsample_flag_##NAME##_) {                    \
-      EMIT((downsample_buf_##NAME##_ + sample) >> 1);   \
-      downsample_flag_##NAME##_ = false;                \
-    } else {                                            \
-      downsample_buf_##NAME##_ = sample;                \
-      downsample_flag_##NAME##_ = true;                 \
-    }                                                   \
-  }                                                     \
-  void clear_##NAME() {                                 \
-    downsample_buf_##NAME##_ = 0;                       \
-    downsample_flag_##NAME##_ = false;                  \
-  }                                                     \
-  int16_t downsample_buf_##NAME##_ = 0;                 \
-  bool downsample_flag_##NAME##_ = false
-
 // PlayWav reads a file from serialflash or SD and converts
 // it into a stream of samples. Note that because it can
 // spend some time reading data between samples, the
@@ -68,6 +54,7 @@ public:
   void Play(const char* filename) {
     if (!*filename) return;
     strcpy(filename_, filename);
+    play_file_id_ = Effect::FileID();
     run_ = true;
   }
 
@@ -76,7 +63,13 @@ public:
   }
 
   void PlayOnce(Effect* effect, float start = 0.0) {
-    if (effect->Play(filename_)) {
+    PlayAt(effect->RandomFile(), start);
+  }
+  // Plays |f| from |start| seconds in.
+  void PlayAt(Effect::FileID f, float start) {
+    if (f) {
+      f.GetName(filename_);
+      play_file_id_ = f;
       start_ = start;
       effect_ = nullptr;
       run_ = true;
@@ -85,12 +78,15 @@ public:
   void PlayLoop(Effect* effect) {
     effect_ = effect;
   }
+  Effect* loop_effect() const { return effect_; }
+  Effect::FileID file_id() const { return new_file_id_; }
 
   void Stop() override {
     state_machine_.reset_state_machine();
     effect_ = nullptr;
     run_ = false;
     written_ = num_samples_ = 0;
+    old_file_id_ = Effect::FileID();
   }
 
   bool isPlaying() const {
@@ -98,27 +94,97 @@ public:
   }
 
 private:
+  // Samples go straight into the reader's buffer. The up-samplers
+  // can produce a few samples more than there is room for, those
+  // are kept in samples_ until the next read().
   void Emit1(uint16_t sample) {
-    samples_[num_samples_++] = sample;
+    if (to_read_) {
+      *(dest_++) = sample;
+      to_read_--;
+    } else {
+      samples_[num_samples_++] = sample;
+    }
   }
   UPSAMPLE_FUNC(Emit2, Emit1);
   UPSAMPLE_FUNC(Emit4, Emit2);
-  DOWNSAMPLE_FUNC(Emit05, Emit1);
-
-  uint32_t header(int n) const {
-    return ((uint32_t *)buffer)[n+2];
-  }
 
   template<int bits> int16_t read2() {
     if (bits == 8) return *(ptr_++) << 8;
     ptr_ += bits / 8 - 2;
-    return *((*((int16_t**)&ptr_))++);
+    int16_t ret;
+    memcpy(&ret, ptr_, 2);
+    ptr_ += 2;
+    return ret;
+  }
+
+  template<int rate>
+  void EmitRate(int16_t v) {
+    if (rate == AUDIO_RATE) {
+      Emit1(v);
+    } else if (rate == AUDIO_RATE / 2) {
+      Emit2(v);
+    } else if (rate == AUDIO_RATE / 4) {
+      Emit4(v);
+    } else {
+      int16_t tmp;
+      resampler_.Put(v);
+      while (resampler_.Get(&tmp)) Emit1(tmp);
+    }
   }
 
+  // IMA ADPCM, four bytes per channel at a time. Mono has the
+  // codes for 8 samples in every 4 bytes, stereo alternates between
+  // 4 bytes of left and 4 bytes of right.
+  template<int channels, int rate>
+  void DecodeAdpcm() {
+    while (ptr_ <= end_ - 4 * channels && to_read_) {
+      if (!block_left_) {
+        int v = 0;
+        for (int c = 0; c < channels; c++) {
+          v += adpcm_[c].Start(ptr_);
+          ptr_ += 4;
+        }
+        EmitRate<rate>(v >> (channels - 1));
+        block_left_ = block_align_ - 4 * channels;
+        continue;
+      }
+      int16_t left[8];
+      for (int i = 0; i < 4; i++) {
+        left[i * 2] = adpcm_[0].Decode(ptr_[i] & 15);
+        left[i * 2 + 1] = adpcm_[0].Decode(ptr_[i] >> 4);
+      }
+      if (channels == 1) {
+        for (int i = 0; i < 8; i++) EmitRate<rate>(left[i]);
+      } else {
+        for (int i = 0; i < 4; i++) {
+          int a = adpcm_[1].Decode(ptr_[i + 4] & 15);
+          int b = adpcm_[1].Decode(ptr_[i + 4] >> 4);
+          EmitRate<rate>((left[i * 2] + a) >> 1);
+          EmitRate<rate>((left[i * 2 + 1] + b) >> 1);
+        }
+      }
+      ptr_ += 4 * channels;
+      block_left_ -= 4 * channels;
+    }
+  }
+
+  // Decodes until we run out of input or output space.
   template<int bits, int channels, int rate>
   void DecodeBytes4() {
-    while (ptr_ < end_ - channels * bits / 8 &&
-           num_samples_ < (int)NELEM(samples_)) {
+    if (bits == 4) {
+      DecodeAdpcm<channels, rate>();
+      return;
+    }
+    if (bits == 16 && channels == 1 && rate == AUDIO_RATE) {
+      // Common case, no conversion needed.
+      int n = min(to_read_, (int)(end_ - ptr_) / 2);
+      memcpy(dest_, ptr_, n * 2);
+      dest_ += n;
+      ptr_ += n * 2;
+      to_read_ -= n;
+      return;
+    }
+    while (ptr_ <= end_ - channels * bits / 8 && to_read_) {
       int v = 0;
       if (channels == 1) {
         v = read2<bits>();
@@ -127,18 +193,7 @@ private:
         v += read2<bits>();
         v >>= 1;
       }
-      if (rate == AUDIO_RATE) {
-        Emit1(v);
-      } else if (rate == AUDIO_RATE / 2) {
-        Emit2(v);
-      } else if (rate == AUDIO_RATE / 4) {
-        Emit4(v);
-      } else if (rate == AUDIO_RATE * 2) {
-        Emit05(v);
-      } else {
-        STDOUT.println("Unsupported rate.");
-        Stop();
-      }
+      EmitRate<rate>(v);
     }
   }
 
@@ -150,6 +205,8 @@ private:
       DecodeBytes4<bits, channels, 22050>();
     else if (rate_ == 11025)
       DecodeBytes4<bits, channels, 11025>();
+    else
+      DecodeBytes4<bits, channels, 0>();
   }
 
   template<int bits>
@@ -159,30 +216,90 @@ private:
   }
 
   void DecodeBytes() {
-    if (bits_ == 8) DecodeBytes2<8>();
+    if (bits_ == 4) DecodeBytes2<4>();
+    else if (bits_ == 8) DecodeBytes2<8>();
     else if (bits_ == 16) DecodeBytes2<16>();
     else if (bits_ == 24) DecodeBytes2<24>();
     else if (bits_ == 32) DecodeBytes2<32>();
   }
 
+  // Smallest number of bytes that DecodeBytes() can make progress with.
+  int frame_bytes() const {
+    return bits_ == 4 ? 4 * channels_ : channels_ * bits_ / 8;
+  }
+
   int ReadFile(int n) { return file_.Read(buffer + 8, n); }
 
+  // Samples per IMA ADPCM block: the one in the block header,
+  // then two per byte.
+  uint32_t adpcm_block_samples() const {
+    return 1 + (block_align_ - 4 * channels_) * 2 / channels_;
+  }
+
+  // Number of samples in |bytes| of sample data.
+  uint32_t bytes_to_samples(uint32_t bytes) const {
+    if (bits_ == 4) {
+      uint32_t blocks = bytes / block_align_;
+      uint32_t rest = bytes % block_align_;
+      uint32_t samples = blocks * adpcm_block_samples();
+      if (rest >= 4u * channels_)
+        samples += 1 + (rest - 4 * channels_) * 2 / channels_;
+      return samples;
+    }
+    return bytes / (channels_ * bits_ / 8);
+  }
+
+  bool SetFormat(const WavHeader& h) {
+    channels_ = h.channels;
+    rate_ = h.rate;
+    bits_ = h.bits;
+    block_align_ = h.block_align;
+    if (rate_ != 44100 && rate_ != 22050 && rate_ != 11025) {
+      if (!Resampler::Supported(rate_)) {
+        STDOUT.println("Unsupported rate.");
+        return false;
+      }
+      resampler_.SetRate(rate_);
+    }
+    return true;
+  }
+
   void loop() {
     STATE_MACHINE_BEGIN();
     while (true) {
       while (!run_ && !effect_) YIELD();
-      new_file_id_ = Effect::FileID();
+      new_file_id_ = play_file_id_;
+      played_ = 0;
       if (!run_) {
         new_file_id_ = effect_->RandomFile();
         if (!new_file_id_) goto fail;
         new_file_id_.GetName(filename_);
         run_ = true;
       }
+      cached_ = new_file_id_ ? new_file_id_.GetWavHeader() : nullptr;
+      preloaded_ = 0;
+      block_left_ = 0;
+      if (cached_) {
+        // Parsed when the font was scanned.
+        if (!SetFormat(*cached_)) goto fail;
+        if (cached_->preload_bytes && start_ == 0.0) {
+          // Start playing from RAM, then pick up from the
+          // SD card where the preloaded part ends.
+          ptr_ = Effect::preload_arena + cached_->preload_offset;
+          end_ = ptr_ + cached_->preload_bytes;
+          while (ptr_ <= end_ - frame_bytes()) {
+            while (to_read_ == 0) YIELD();
+            DecodeBytes();
+          }
+          preloaded_ = cached_->preload_bytes;
+        }
+      }
       if (new_file_id_ && new_file_id_ == old_file_id_) {
         // Minor optimization: If we're reading the same file
         // as before, then seek to 0 instead of open/close file.
         file_.Rewind();
       } else {
+        old_file_id_ = Effect::FileID();
 	if (!file_.Open(filename_)) {
 	  STDOUT.print("File ");
 	  STDOUT.print(filename_);
@@ -193,82 +310,43 @@ private:
         old_file_id_ = new_file_id_;
       }
       wav_ = endswith(".wav", filename_);
-      if (wav_) {
-        if (ReadFile(12) != 12) {
-          STDOUT.println("Failed to read 12 bytes.");
-          goto fail;
-        }
-        if (header(0) != 0x46464952 || header(2) != 0x45564157) {
-          STDOUT.println("Not RIFF WAVE.");
-          YIELD();
-          goto fail;
-        }
-
-        // Look for FMT header.
-        while (true) {
-          if (ReadFile(8) != 8) {
-            STDOUT.println("Failed to read 8 bytes.");
-            goto fail;
-          }
-
-          len_ = header(1);
-          if (header(0) != 0x20746D66) {  // 'fmt '
-            file_.Skip(len_);
-            continue;
-          }
-          if (len_ < 16) {
-            STDOUT.println("FMT header is wrong size..");
-            goto fail;
-          }
-          break;
-        }
-        
-        if (16 != ReadFile(16)) {
-          STDOUT.println("Read failed.");
-          goto fail;
-        }
-        if (len_ > 16) file_.Skip(len_ - 16);
-        if ((header(0) & 0xffff) != 1) {
-          STDOUT.println("Wrong format.");
-          goto fail;
-        }
-        channels_ = header(0) >> 16;
-        rate_ = header(1);
-        bits_ = header(3) >> 16;
+      if (cached_) {
+        file_.Seek(cached_->data_offset + preloaded_);
+        len_ = cached_->data_bytes - preloaded_;
       } else {
-         channels_ = 1;
-         rate_ = 44100;
-         bits_ = 16;
+        WavHeader h;
+        if (!ReadWavHeader(&file_, wav_, &h)) goto fail;
+        STDOUT.print("channels: ");
+        STDOUT.print(h.channels);
+        STDOUT.print(" rate: ");
+        STDOUT.print(h.rate);
+        STDOUT.print(" bits: ");
+        STDOUT.println(h.bits);
+        if (!SetFormat(h)) goto fail;
+        len_ = h.data_bytes;
       }
-      STDOUT.print("channels: ");
-      STDOUT.print(channels_);
-      STDOUT.print(" rate: ");
-      STDOUT.print(rate_);
-      STDOUT.print(" bits: ");
-      STDOUT.println(bits_);
 
       ptr_ = buffer + 8;
       end_ = buffer + 8;
       
       while (true) {
-        if (wav_) {
-          if (ReadFile(8) != 8) break;
-          len_ = header(1);
-          if (header(0) != 0x61746164) {
-            file_.Skip(len_);
-            continue;
-          }
-        } else {
-          if (file_.Tell() >= file_.FileSize()) break;
-          len_ = file_.FileSize() - file_.Tell();
-        }
-        sample_bytes_ = len_;
+        sample_bytes_ = len_ + preloaded_;
+        preloaded_ = 0;
 
         if (start_ != 0.0) {
           int samples = fmod(start_, length()) * rate_;
-          int bytes_to_skip = samples * channels_ * bits_ / 8;
+          int bytes_to_skip;
+          if (bits_ == 4) {
+            // Can only start decoding at the beginning of a block.
+            int blocks = samples / adpcm_block_samples();
+            samples = blocks * adpcm_block_samples();
+            bytes_to_skip = blocks * block_align_;
+          } else {
+            bytes_to_skip = samples * channels_ * bits_ / 8;
+          }
           file_.Skip(bytes_to_skip);
           len_ -= bytes_to_skip;
+          played_ = (uint64_t)samples * AUDIO_RATE / rate_;
           start_ = 0.0;
         }
 
@@ -280,20 +358,9 @@ private:
             len_ -= bytes_read;
             end_ = buffer + 8 + bytes_read;
           }
-          while (ptr_ < end_ - channels_ * bits_ / 8) {
+          while (ptr_ <= end_ - frame_bytes()) {
+            while (to_read_ == 0) YIELD();
             DecodeBytes();
-
-            while (written_ < num_samples_) {
-              // Preload should go to here...
-              while (to_read_ == 0) YIELD();
-
-              int n = min(num_samples_ - written_, to_read_);
-              memcpy(dest_, samples_ + written_, n * 2);
-              dest_ += n;
-              written_ += n;
-              to_read_ -= n;
-            }
-            written_ = num_samples_ = 0;
           }
           if (ptr_ < end_) {
             memmove(buffer + 8 - (end_ - ptr_),
@@ -303,6 +370,14 @@ private:
           ptr_ = buffer + 8 - (end_ - ptr_);
         }
         YIELD();
+        if (!wav_) break;
+        {
+          // Wav files can have more than one data chunk.
+          uint32_t len;
+          if (!FindWavChunk(&file_, 0x61746164, &len)) break;
+          len_ = len;
+          block_left_ = 0;
+        }
       }
 
       // EOF;
@@ -322,7 +397,17 @@ public:
   int read(int16_t* dest, int to_read) override {
     dest_ = dest;
     to_read_ = to_read;
-    loop();
+    // Left-overs from last time go first.
+    if (written_ < num_samples_) {
+      int n = min(num_samples_ - written_, to_read_);
+      memcpy(dest_, samples_ + written_, n * 2);
+      dest_ += n;
+      written_ += n;
+      to_read_ -= n;
+      if (written_ == num_samples_) written_ = num_samples_ = 0;
+    }
+    if (to_read_) loop();
+    played_ += dest_ - dest;
     return dest_ - dest;
   }
 
@@ -332,23 +417,41 @@ public:
 
   // Length, seconds.
   float length() const {
-    return (float)(sample_bytes_) * 8 / (bits_ * rate_);
+    if (!rate_) return 0.0f;
+    return (float)bytes_to_samples(sample_bytes_) / rate_;
+  }
+
+  // How far into the current file we are, in seconds. Only exact
+  // to within one read().
+  float position() const {
+    return played_ * (1.0f / AUDIO_RATE);
   }
 
 private:
   volatile bool run_ = false;
   Effect* volatile effect_ = nullptr;
+  // File picked by PlayOnce(), so we can use its cached header.
+  Effect::FileID play_file_id_;
   Effect::FileID new_file_id_;
+  const WavHeader* cached_;
+  // Bytes of sample data that were played from Effect::preload_arena.
+  uint32_t preloaded_;
   Effect::FileID old_file_id_;
   char filename_[128];
   int16_t* dest_ = nullptr;
   int to_read_ = 0;
   int tmp_;
   float start_ = 0.0;
+  // Samples handed out since the current file started.
+  volatile uint32_t played_ = 0;
 
-  int rate_;
-  uint8_t channels_;
-  uint8_t bits_;
+  int rate_ = 0;
+  uint8_t channels_ = 1;
+  uint8_t bits_ = 16;
+  // IMA ADPCM block size and bytes left of the current block.
+  uint16_t block_align_ = 0;
+  uint16_t block_left_ = 0;
+  ImaAdpcmChannel adpcm_[2];
 
   bool wav_;
 
@@ -366,7 +469,11 @@ private:
   
   // Number of samples in samples_
   int num_samples_ = 0;
-  int16_t samples_[32];
+  // Enough for one ADPCM group of 8 samples at the highest
+  // up-sampling ratio.
+  int16_t samples_[64];
+
+  Resampler resampler_;
 };
 
 #endif
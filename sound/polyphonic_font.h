@@ -24,7 +24,7 @@ public:
     STDOUT.println("Activating polyphonic font.");
     SetupStandardAudio();
     hum_player_ = RequireFreeWavPlayer();
-    hum_player_->set_volume_now(0);
+    if (hum_player_) hum_player_->set_volume_now(0);
     config_.ReadInCurrentDir("config.ini");
     SaberBase::Link(this);
     state_ = STATE_OFF;
@@ -44,6 +44,7 @@ public:
   }
 
   void SB_On() override {
+    if (!hum_player_) return;
     state_ = STATE_OUT;
     hum_player_->PlayOnce(&hum);
     hum_player_->PlayLoop(&hum);
@@ -64,9 +65,10 @@ public:
     Play(&in);
   }
 
-  RefPtr<BufferedWavPlayer> Play(Effect* f)  {
+  RefPtr<BufferedWavPlayer> Play(Effect* f,
+                                 VoicePriority priority = VOICE_NORMAL)  {
     EnableAmplifier();
-    RefPtr<BufferedWavPlayer> player = GetFreeWavPlayer();
+    RefPtr<BufferedWavPlayer> player = GetFreeWavPlayer(priority);
     if (player) {
       player->set_volume_now(config_.volEff / 16.0);
       player->PlayOnce(f);
@@ -88,7 +90,7 @@ public:
       e = &drag;
     }
     if (!lock_player_) {
-      lock_player_ = Play(e);
+      lock_player_ = Play(e, VOICE_HIGH);
       if (lock_player_) {
         lock_player_->PlayLoop(e);
       }
@@ -108,6 +110,7 @@ public:
   uint32_t last_micros_;
 
   void SetHumVolume(float vol) override {
+    if (!hum_player_) return;
     uint32_t m = micros();
     switch (state_) {
       case STATE_OFF:
@@ -151,7 +154,7 @@ public:
     if (speed > 250.0) {
       if (!swinging_ && state_ != STATE_OFF) {
         swinging_ = true;
-        Play(&swng);
+        Play(&swng, VOICE_LOW);
       }
     } else {
       swinging_ = false;
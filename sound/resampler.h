@@ -0,0 +1,160 @@
+#ifndef SOUND_RESAMPLER_H
+#define SOUND_RESAMPLER_H
+
+// Fixed-point sample rate converter for wav files that are not at
+// AUDIO_RATE (or a power of two below it).
+// Each output sample is a windowed sinc over the nearby input samples.
+// The sinc is tabulated once at 64 points per zero crossing, and taps
+// interpolate linearly between table entries, so the same table works
+// for any ratio. When downsampling, the sinc is stretched so that it
+// cuts off at the output nyquist frequency, which takes more taps.
+// Input rates are limited to 4 x AUDIO_RATE, which caps the cost at
+// 64 taps per output sample.
+
+// Right half of a Kaiser (beta = 7) windowed sinc, cutoff at 0.9 x
+// nyquist, 8 zero crossings, Q15.
+const int16_t resampler_table[513] = {
+  29491,29481,29451,29402,29332,29243,29134,29006,28858,28692,28506,
+  28302,28079,27838,27580,27304,27010,26700,26374,26032,25674,25301,
+  24913,24511,24096,23667,23226,22773,22308,21832,21346,20850,20345,
+  19831,19309,18780,18244,17703,17155,16603,16047,15487,14925,14360,
+  13793,13226,12658,12091,11524,10959,10397,9837,9280,8727,8179,
+  7636,7099,6567,6043,5525,5016,4514,4021,3538,3064,2599,2145,1702,
+  1270,849,440,43,-341,-713,-1073,-1419,-1752,-2072,-2378,-2670,
+  -2949,-3214,-3465,-3702,-3925,-4133,-4328,-4509,-4676,-4829,-4969,
+  -5094,-5207,-5306,-5391,-5464,-5524,-5571,-5606,-5628,-5639,-5638,
+  -5626,-5603,-5570,-5525,-5471,-5407,-5334,-5252,-5161,-5062,-4955,
+  -4840,-4719,-4590,-4456,-4315,-4169,-4018,-3862,-3702,-3539,-3371,
+  -3201,-3028,-2852,-2675,-2496,-2316,-2136,-1955,-1773,-1593,-1413,
+  -1234,-1056,-880,-706,-534,-365,-199,-36,124,280,432,581,725,864,
+  999,1129,1254,1374,1488,1597,1701,1799,1892,1978,2059,2134,2203,
+  2267,2324,2376,2421,2461,2495,2523,2546,2562,2574,2580,2580,2575,
+  2565,2551,2531,2506,2477,2443,2406,2364,2318,2268,2215,2158,2098,
+  2035,1969,1900,1829,1756,1680,1603,1524,1443,1362,1279,1195,1110,
+  1025,940,854,768,683,598,513,429,346,264,183,104,26,-51,-126,-199,
+  -270,-339,-406,-471,-534,-594,-651,-706,-759,-809,-856,-900,-942,
+  -980,-1016,-1049,-1080,-1107,-1132,-1153,-1172,-1188,-1201,-1212,
+  -1219,-1224,-1227,-1227,-1224,-1219,-1211,-1201,-1189,-1175,-1158,
+  -1140,-1119,-1097,-1073,-1047,-1019,-990,-960,-928,-895,-861,-826,
+  -790,-753,-716,-678,-639,-600,-560,-520,-480,-440,-400,-360,-320,
+  -280,-241,-202,-163,-125,-88,-52,-16,19,54,87,119,150,181,210,238,
+  265,290,315,338,360,381,400,418,435,450,464,477,488,498,507,515,
+  521,526,529,532,533,533,532,530,527,523,518,512,504,496,488,478,
+  467,456,444,432,419,405,391,376,361,346,330,314,298,282,265,248,
+  231,214,198,181,164,147,131,115,98,83,67,52,37,22,8,-6,-20,-33,
+  -45,-57,-69,-80,-91,-101,-110,-119,-128,-136,-143,-150,-157,-163,
+  -168,-173,-177,-181,-184,-186,-189,-190,-191,-192,-192,-192,-192,
+  -191,-189,-188,-185,-183,-180,-177,-173,-170,-166,-162,-157,-152,
+  -148,-143,-137,-132,-127,-121,-115,-110,-104,-98,-92,-87,-81,-75,
+  -69,-64,-58,-52,-47,-41,-36,-31,-26,-21,-16,-12,-7,-3,1,5,9,13,16,
+  20,23,26,28,31,33,36,38,39,41,43,44,45,46,47,48,48,48,49,49,49,49,
+  48,48,47,47,46,45,44,43,42,41,40,39,38,36,35,34,32,31,30,28,27,25,
+  24,22,21,20,18,17,16,14,13,12,11,10,8,7,6,5,4,4,3,2,1,1,0,-1,-1,
+  -2,-2,-3,-3,-3,-4,-4,-4,-4,-4,-4,0
+};
+
+class Resampler {
+public:
+  enum {
+    kZeroCrossings = 8,
+    kSamplesPerZeroCrossing = 64,
+    kTableEnd = kZeroCrossings * kSamplesPerZeroCrossing,
+    kHistory = 128,
+  };
+
+  static bool Supported(uint32_t rate) {
+    return rate >= 8000 && rate <= AUDIO_RATE * 4;
+  }
+
+  // Call when a new file starts. Clears the history even if the
+  // rate is the same as last time.
+  void SetRate(uint32_t rate) {
+    Reset();
+    if (rate == rate_) return;
+    rate_ = rate;
+    step_ = ((uint64_t)rate << 16) / AUDIO_RATE;
+    step_remainder_ = ((uint64_t)rate << 16) % AUDIO_RATE;
+    if (rate > AUDIO_RATE) {
+      hstep_ = ((uint64_t)AUDIO_RATE * kSamplesPerZeroCrossing << 16) / rate;
+      gain_ = ((uint64_t)AUDIO_RATE << 15) / rate;
+    } else {
+      hstep_ = kSamplesPerZeroCrossing << 16;
+      gain_ = 1 << 15;
+    }
+    reach_ = ((uint64_t)kTableEnd << 32) / hstep_;
+  }
+
+  void Reset() {
+    memset(history_, 0, sizeof(history_));
+    head_ = 0;
+    // The first output lines up with the first input.
+    pos_ = 1 << 16;
+    remainder_ = 0;
+  }
+
+  // Adds one input sample, call Get() until it returns false after this.
+  void Put(int16_t sample) {
+    head_ = (head_ + 1) & (kHistory - 1);
+    history_[head_] = sample;
+    pos_ -= 1 << 16;
+  }
+
+  bool Get(int16_t* out) {
+    if (pos_ + reach_ > 0) return false;
+    *out = Interpolate(pos_);
+    pos_ += step_;
+    // Keep the rounding error of step_ from adding up.
+    remainder_ += step_remainder_;
+    if (remainder_ >= AUDIO_RATE) {
+      remainder_ -= AUDIO_RATE;
+      pos_++;
+    }
+    return true;
+  }
+
+private:
+  int16_t history(int k) const {
+    return history_[(head_ + k) & (kHistory - 1)];
+  }
+
+  // Filter value |h| (Q16) table entries away from the center.
+  static int32_t Tap(uint32_t h) {
+    int i = h >> 16;
+    int32_t f = (h >> 1) & 0x7fff;
+    return resampler_table[i] +
+      (((resampler_table[i + 1] - resampler_table[i]) * f) >> 15);
+  }
+
+  // |pos| is relative to the newest input sample, in Q16.
+  int16_t Interpolate(int32_t pos) const {
+    int k = pos >> 16;
+    uint32_t frac = pos & 0xffff;
+    int64_t acc = 0;
+    // Left wing, input samples at or before pos.
+    uint32_t h = ((uint64_t)frac * hstep_) >> 16;
+    for (int i = k; h < (uint32_t)kTableEnd << 16; i--, h += hstep_)
+      acc += history(i) * Tap(h);
+    // Right wing.
+    h = ((uint64_t)(0x10000 - frac) * hstep_) >> 16;
+    for (int i = k + 1; h < (uint32_t)kTableEnd << 16; i++, h += hstep_)
+      acc += history(i) * Tap(h);
+    return clamptoi16((int32_t)(acc >> 15) * gain_ >> 15);
+  }
+
+  uint32_t rate_ = 0;
+  // Input samples per output sample, Q16.
+  uint32_t step_;
+  uint32_t step_remainder_;
+  uint32_t remainder_;
+  // Distance between taps, in table entries, Q16.
+  uint32_t hstep_;
+  // How far the filter extends to each side, in input samples, Q16.
+  int32_t reach_;
+  int32_t gain_;
+  // Position of the next output sample relative to history_[head_], Q16.
+  int32_t pos_;
+  int head_;
+  int16_t history_[kHistory];
+};
+
+#endif
@@ -1,6 +1,20 @@
 #ifndef SOUND_SMOOTH_SWING_V2_H
 #define SOUND_SMOOTH_SWING_V2_H
 
+#ifndef SMOOTH_SWING_UPDATE_MICROS
+// How often the swing volumes are recomputed. The volume ramps in
+// the wav players smooth out the steps in between.
+#define SMOOTH_SWING_UPDATE_MICROS 1000
+#endif
+
+#ifndef SMOOTH_SWING_PREPARE_FRACTION
+// Silent swing players may go virtual, see BufferedWavPlayer. They
+// are restarted once the swing speed reaches this fraction of
+// SwingStrengthThreshold, so they are streaming again before the
+// swing can be heard.
+#define SMOOTH_SWING_PREPARE_FRACTION 0.5f
+#endif
+
 // SmoothSwing V2, based on Thexter's excellent work.
 // For more details, see:
 // http://therebelarmory.com/thread/9138/smoothswing-v2-algorithm-description
@@ -16,6 +30,10 @@ public:
       STDOUT.println("Warning, swingl and swingh should have the same number of files.");
     }
     swings_ = min(swingl.files_found(), swingh.files_found());
+    curve_.Setup(smooth_swing_config.SwingSensitivity,
+                 smooth_swing_config.SwingSharpness,
+                 smooth_swing_config.MaximumHumDucking,
+                 smooth_swing_config.MaxSwingVolume);
   }
 
   void Deactivate() {
@@ -28,9 +46,10 @@ public:
     B = C;
   }
 
-  // Should only be done when the volume is near zero.
-  void PickRandomSwing() {
-    if (!on_) return;
+  // Starts a random pair, at an offset that keeps it in step with
+  // the hum. Only done when the saber turns on, or if the swing
+  // players have stopped for some reason.
+  void StartSwings() {
     int swing = random(swings_);
     float start = millis() / 1000.0;
     A.Stop();
@@ -39,6 +58,27 @@ public:
     swingh.Select(swing);
     A.Play(&swingl, start);
     B.Play(&swingh, start);
+    PickTransitions();
+  }
+
+  // Picks the pair for the next swing. The players keep streaming
+  // the current pair and move on to the new one where the files loop,
+  // so nothing is opened or seeked when a swing starts. Players that
+  // went virtual are restarted a little ahead of the swing instead.
+  // Should only be done when the volume is near zero.
+  void PickRandomSwing() {
+    if (!on_) return;
+    if (!A.isPlaying() || !B.isPlaying()) {
+      StartSwings();
+      return;
+    }
+    int swing = random(swings_);
+    swingl.Select(swing);
+    swingh.Select(swing);
+    PickTransitions();
+  }
+
+  void PickTransitions() {
     if (random(2)) Swap();
     float t1_offset = random(1000) / 1000.0 * 50 + 10;
     A.SetTransition(t1_offset, smooth_swing_config.Transition1Degrees);
@@ -50,7 +90,7 @@ public:
     on_ = true;
     // Starts hum, etc.
     delegate_->SB_On();
-    PickRandomSwing();
+    StartSwings();
     if (!A.player || !B.player) {
       STDOUT.println("SmoothSwing V2 cannot allocate wav player.");
     }
@@ -76,16 +116,21 @@ public:
     Vec3 gyro = gyro_filter_.filter(raw_gyro);
     // degrees per second
     // May not need to smooth gyro since volume is smoothed.
-    float speed = sqrt(gyro.z * gyro.z + gyro.y * gyro.y);
+    float speed = sqrtf(gyro.z * gyro.z + gyro.y * gyro.y);
     uint32_t t = micros();
     uint32_t delta = t - last_micros_;
     if (delta > 1000000) delta = 1;
     last_micros_ = t;
-    float hum_volume = 1.0;
+    float hum_volume = 1.0f;
     
     switch (state_) {
       case SwingState::OFF:
         if (speed < smooth_swing_config.SwingStrengthThreshold) {
+          if (speed >= smooth_swing_config.SwingStrengthThreshold *
+              SMOOTH_SWING_PREPARE_FRACTION) {
+            A.Prepare();
+            B.Prepare();
+          }
 #if 1
           if (monitor.ShouldPrint(Monitoring::MonitorSwings)) {
             STDOUT.print("speed: ");
@@ -97,34 +142,32 @@ public:
         state_ = SwingState::ON;
         
       case SwingState::ON:
-        if (speed >= smooth_swing_config.SwingStrengthThreshold * 0.9) {
-          float swing_strength =
-            min(1.0, speed / smooth_swing_config.SwingSensitivity);
-          A.rotate(-speed * delta / 1000000.0);
+        if (speed >= smooth_swing_config.SwingStrengthThreshold * 0.9f) {
+          float degrees = -speed * delta * 1e-6f;
+          A.rotate(degrees);
           // If the current transition is done, switch A & B,
           // and set the next transition to be 180 degrees from the one
           // that is done.
-          while (A.end() < 0.0) {
-            B.midpoint = A.midpoint + 180.0;
+          while (A.end() < 0.0f) {
+            B.midpoint = A.midpoint + 180.0f;
 	    Swap();
           }
-          float mixab = 0.0;
-          if (A.begin() < 0.0)
-            mixab = clamp(- A.begin() / A.width, 0.0, 1.0);
-
-          float mixhum =
-            pow(swing_strength, smooth_swing_config.SwingSharpness);
-
-          hum_volume =
-            1.0 - mixhum * smooth_swing_config.MaximumHumDucking / 100.0;
-
-          mixhum *= smooth_swing_config.MaxSwingVolume;
+          if (t - last_update_ < SMOOTH_SWING_UPDATE_MICROS) {
+            hum_volume = hum_volume_;
+            break;
+          }
+          last_update_ = t;
+          int32_t strength = curve_.Strength(speed);
+          int32_t mixab = SwingCurve::Transition(A.begin(), A.inv_width);
+          int32_t mixhum = curve_.SwingVolume(strength);
+          hum_volume = hum_volume_ =
+            curve_.HumVolume(strength) * (1.0f / SwingCurve::kOne);
 
           if (monitor.ShouldPrint(Monitoring::MonitorSwings)) {
             STDOUT.print("speed: ");
             STDOUT.print(speed);
             STDOUT.print(" R: ");
-            STDOUT.print(-speed * delta / 1000000.0);
+            STDOUT.print(degrees);
             STDOUT.print(" MP: ");
             STDOUT.print(A.midpoint);
             STDOUT.print(" B: ");
@@ -132,14 +175,14 @@ public:
             STDOUT.print(" E: ");
             STDOUT.print(A.end());
             STDOUT.print("  mixhum: ");
-            STDOUT.print(mixhum);
+            STDOUT.print(mixhum * (1.0f / SwingCurve::kOne));
             STDOUT.print("  mixab: ");
-            STDOUT.print(mixab);
+            STDOUT.print(mixab * (1.0f / SwingCurve::kOne));
             STDOUT.print("  hum_volume: ");
             STDOUT.println(hum_volume);
           }
-          A.set_volume(mixhum * mixab);
-          B.set_volume(mixhum * (1.0 - mixab));
+          A.set_volume(((int64_t)mixhum * mixab) >> SwingCurve::kShift);
+          B.set_volume(((int64_t)mixhum * (SwingCurve::kOne - mixab)) >> SwingCurve::kShift);
           break;
         }
         A.set_volume(0);
@@ -161,14 +204,17 @@ public:
 
 private:
   struct Data {
-    void set_volume(float v) {
-      if (player) player->set_volume(v);
+    // |v| is scaled by SwingCurve::kOne.
+    void set_volume(int32_t v) {
+      if (player) player->set_volume((int)(((int64_t)v * kDefaultVolume) >> SwingCurve::kShift));
     }
     void Play(Effect* effect, float start = 0.0) {
       if (!player) {
 	player = GetFreeWavPlayer();
 	if (!player) return;
       }
+      // Silent between swings, so it may go virtual until the
+      // next one is about to start, see SB_Motion().
       player->set_volume(0.0);
       player->PlayOnce(effect, start);
       player->PlayLoop(effect);
@@ -183,13 +229,20 @@ private:
       if (!player) return;
       player->Stop();
     }
+    void Prepare() {
+      if (player) player->Prepare();
+    }
     bool isOff() {
       if (!player) return true;
       return player->isOff();
     }
+    bool isPlaying() {
+      return player && player->isPlaying();
+    }
     void SetTransition(float mp, float w) {
       midpoint = mp;
       width = w;
+      inv_width = 1.0f / w;
     }
     float begin() const { return midpoint - width / 2; }
     float end() const { return midpoint + width / 2; }
@@ -199,6 +252,7 @@ private:
     RefPtr<BufferedWavPlayer> player;
     float midpoint = 0.0;
     float width = 0.0;
+    float inv_width = 0.0;
   };
   Data A;
   Data B;
@@ -207,6 +261,9 @@ private:
   BoxFilter<Vec3, 3> gyro_filter_;
   int swings_;
   uint32_t last_micros_;
+  uint32_t last_update_ = 0;
+  float hum_volume_ = 1.0f;
+  SwingCurve curve_;
   SwingState state_ = SwingState::OFF;;
 };
 
@@ -0,0 +1,61 @@
+#ifndef SOUND_SWING_CURVE_H
+#define SOUND_SWING_CURVE_H
+
+// The SmoothSwing V2 volume curves in fixed point.
+// pow() and the divisions only happen in Setup(), when the font
+// is activated. Per gyro sample it's a table lookup and a few
+// multiplies. All results are scaled by kOne.
+class SwingCurve {
+public:
+  static const int kShift = 14;
+  static const int32_t kOne = 1 << kShift;
+  static const int kSteps = 256;
+
+  void Setup(float sensitivity, float sharpness,
+             float ducking_percent, float max_volume) {
+    steps_per_speed_ = kSteps / sensitivity;
+    for (int i = 0; i <= kSteps; i++) {
+      strength_[i] = (uint16_t)(powf(i / (float)kSteps, sharpness) * kOne + 0.5f);
+    }
+    ducking_ = (int32_t)(ducking_percent / 100.0f * kOne + 0.5f);
+    max_volume_ = (int32_t)(max_volume * kOne + 0.5f);
+  }
+
+  // pow(min(1, speed / sensitivity), sharpness)
+  int32_t Strength(float speed) const {
+    float x = speed * steps_per_speed_;
+    if (x >= kSteps) return strength_[kSteps];
+    if (x <= 0.0f) return 0;
+    int32_t fixed = (int32_t)(x * 256);
+    int i = fixed >> 8;
+    int32_t f = fixed & 255;
+    return strength_[i] + (((strength_[i + 1] - strength_[i]) * f) >> 8);
+  }
+
+  // 1 - strength * MaximumHumDucking / 100
+  int32_t HumVolume(int32_t strength) const {
+    return kOne - ((strength * ducking_) >> kShift);
+  }
+
+  // strength * MaxSwingVolume
+  int32_t SwingVolume(int32_t strength) const {
+    return ((int64_t)strength * max_volume_) >> kShift;
+  }
+
+  // How far into a transition that starts at |begin| degrees we are,
+  // clamped to 0..kOne.
+  static int32_t Transition(float begin, float inv_width) {
+    if (begin >= 0.0f) return 0;
+    float x = -begin * inv_width;
+    if (x >= 1.0f) return kOne;
+    return (int32_t)(x * kOne);
+  }
+
+private:
+  float steps_per_speed_ = 0.0f;
+  int32_t ducking_ = 0;
+  int32_t max_volume_ = 0;
+  uint16_t strength_[kSteps + 1] = {};
+};
+
+#endif
@@ -625,33 +625,25 @@ const int32_t lanc2_11[] = {
 class Frame {
 public:
   bool voiced() const { return period != 0; }
-  void lerp(const Frame &A, const Frame &B,
-      int count, int maxcount) {
-    if (!A.inited) {
-      inited = false;
-      energy = period = 0;
-      for (int i = 0; i < 10; i++) k[i] = 0;
-      return;
-    }
-    if (A.voiced() != B.voiced() || !B.inited) {
-      *this = A;
-    } else {
-      int b = count * 16384 / maxcount;
-      int a = 16384 - b;
-      inited = inited;
-      energy = (A.energy * a + B.energy * b) >> 14;
-      period = (A.period * a + B.period * b) >> 14;
-      for (int i = 0; i < 10; i++) {
-	k[i] = (A.k[i] * a + B.k[i] * b) >> 14;
-      }
+  // Blends A and B, |b| goes from 0 (all A) to 16384 (all B).
+  void lerp(const Frame &A, const Frame &B, int b) {
+    int a = 16384 - b;
+    energy = (A.energy * a + B.energy * b) >> 14;
+    period = (A.period * a + B.period * b) >> 14;
+    for (int i = 0; i < 10; i++) {
+      k[i] = (A.k[i] * a + B.k[i] * b) >> 14;
     }
   }
-  int32_t energy;
-  int32_t period;
-  int32_t k[10];
+  int32_t energy = 0;
+  int32_t period = 0;
+  int32_t k[10] = {};
   bool inited = false;
 };
 
+#ifndef TALKIE_QUEUE_SIZE
+#define TALKIE_QUEUE_SIZE 20
+#endif
+
 class Talkie : public AudioStream, CommandParser {
 public:
   struct Word {
@@ -659,26 +651,29 @@ public:
     uint32_t rate;
     const tms5100_coeffs* coeffs;
   };
-  Word words[20];
-  size_t num_words = 0;
 
   Talkie() {
     for (int i = 0; i < 10; i++) x[i] = 0;
   }
 
-  void Say(const uint8_t* addr, uint32_t rate = 25,
+  // Queues up a word. Returns false, and says so, if the queue is full.
+  bool Say(const uint8_t* addr, uint32_t rate = 25,
 	   const tms5100_coeffs* coeffs = &tms5220_coeff
 //	   const tms5100_coeffs* coeffs = &tms5110a_coeff
     ) {
     rate *= 7;
     EnableAmplifier();
+    bool ok = true;
     noInterrupts();
     if (ptrAddr) {
-      if (num_words < NELEM(words)) {
-        words[num_words].ptr = addr;
-        words[num_words].rate = rate;
-        words[num_words].coeffs = coeffs;
-        num_words++;
+      if (num_words_ < NELEM(words_)) {
+        Word& w = words_[(first_word_ + num_words_) % NELEM(words_)];
+        w.ptr = addr;
+        w.rate = rate;
+        w.coeffs = coeffs;
+        num_words_++;
+      } else {
+        ok = false;
       }
     } else {
       rate_ = rate;
@@ -688,6 +683,9 @@ public:
       ptrBit = 0;
     }
     interrupts();
+    if (!ok) STDOUT.println("Talkie queue full, word dropped.");
+    Wake();
+    return ok;
   }
 
   void SayDigit(int digit) {
@@ -751,12 +749,13 @@ public:
       // Energy = 15: stop frame. Silence the synthesiser.
       new_frame.energy = 0;
       for (int i = 0; i < 10; i++) new_frame.k[i] = 0;
-      if (num_words) {
-        ptrAddr = words[0].ptr;
-        rate_ = words[0].rate;
-	coeffs_ = words[0].coeffs;
-        num_words--;
-        for (size_t i = 0; i < num_words; i++) words[i] = words[i + 1];
+      if (num_words_) {
+        const Word& w = words_[first_word_];
+        ptrAddr = w.ptr;
+        rate_ = w.rate;
+	coeffs_ = w.coeffs;
+        first_word_ = (first_word_ + 1) % NELEM(words_);
+        num_words_--;
         ptrBit = 0;
       } else {
         ptrAddr = NULL;
@@ -780,65 +779,92 @@ public:
     }
   }
   
-  int16_t Get8kHz() {
-    if (count_++ >= rate_) {
-      ReadFrame();
-      count_ = 0;
-    }
-
-    Frame f;
-    f.lerp(old_frame, new_frame, count_, rate_);
-
-    
-    int32_t u[11];
+  // Renders |n| samples at 8kHz.
+  // Between frames, the filter coefficients are blended sample by
+  // sample. When there is nothing to blend (silence, or going between
+  // voiced and unvoiced) the decoded frame is used as it is.
+  void Render8kHz(int16_t* out, int n) {
+    int32_t x0 = x[0], x1 = x[1], x2 = x[2], x3 = x[3], x4 = x[4];
+    int32_t x5 = x[5], x6 = x[6], x7 = x[7], x8 = x[8], x9 = x[9];
+    for (int s = 0; s < n; s++) {
+      if (count_++ >= rate_) {
+        ReadFrame();
+        count_ = 0;
+      }
+      if (rate_ != lerp_rate_) {
+        // Rounded up, so that (count * lerp_step_) >> 16 is the same
+        // as count * 16384 / rate for any rate up to 373.
+        lerp_rate_ = rate_;
+        lerp_step_ = rate_ ? ((16384 << 16) + rate_ - 1) / rate_ : 0;
+      }
 
-    if (f.period) {
-      // Voiced source
-      if (periodCounter < f.period) {
-        periodCounter++;
-      } else {
-        periodCounter = 0;
+      Frame blend;
+      const Frame* f = &blend;
+      if (old_frame.inited) {
+        if (old_frame.voiced() != new_frame.voiced() || !new_frame.inited) {
+          f = &old_frame;
+        } else {
+          blend.lerp(old_frame, new_frame, (count_ * lerp_step_) >> 16);
+        }
       }
-      if (periodCounter < MAX_CHIRP_SIZE) {
-        u[10] = ((coeffs_->chirptable[periodCounter]) * f.energy) >> 3;
+
+      int32_t u10;
+      if (f->period) {
+        // Voiced source
+        if (periodCounter < f->period) {
+          periodCounter++;
+        } else {
+          periodCounter = 0;
+        }
+        if (periodCounter < MAX_CHIRP_SIZE) {
+          u10 = ((coeffs_->chirptable[periodCounter]) * f->energy) >> 3;
+        } else {
+          u10 = 0;
+        }
       } else {
-        u[10] = 0;
+        // Unvoiced source
+        synth_rand_ = (synth_rand_ >> 1) ^ ((synth_rand_ & 1) ? 0xB800 : 0);
+        u10 = ((synth_rand_ & 1) ? f->energy : -f->energy) << 3;
       }
-    } else {
-      // Unvoiced source
-      static uint16_t synthRand = 1;
-      synthRand = (synthRand >> 1) ^ ((synthRand & 1) ? 0xB800 : 0);
-      u[10] = ((synthRand & 1) ? f.energy : -f.energy) << 3;
-    }
 
+      const int32_t* k = f->k;
 #define matrix_multiply(X, Y) (((X)*(Y)) >> 9)
-    u[9] = u[10] - matrix_multiply(f.k[9], x[9]);
-    u[8] = u[9] - matrix_multiply(f.k[8], x[8]);
-    u[7] = u[8] - matrix_multiply(f.k[7], x[7]);
-    u[6] = u[7] - matrix_multiply(f.k[6], x[6]);
-    u[5] = u[6] - matrix_multiply(f.k[5], x[5]);
-    u[4] = u[5] - matrix_multiply(f.k[4], x[4]);
-    u[3] = u[4] - matrix_multiply(f.k[3], x[3]);
-    u[2] = u[3] - matrix_multiply(f.k[2], x[2]);
-    u[1] = u[2] - matrix_multiply(f.k[1], x[1]);
-    u[0] = u[1] - matrix_multiply(f.k[0], x[0]);
-
-    // Output clamp
-    if (u[0] > 511) u[0] = 511;
-    if (u[0] < -512) u[0] = -512;
-
-    x[9] = x[8] + matrix_multiply(f.k[8], u[8]);
-    x[8] = x[7] + matrix_multiply(f.k[7], u[7]);
-    x[7] = x[6] + matrix_multiply(f.k[6], u[6]);
-    x[6] = x[5] + matrix_multiply(f.k[5], u[5]);
-    x[5] = x[4] + matrix_multiply(f.k[4], u[4]);
-    x[4] = x[3] + matrix_multiply(f.k[3], u[3]);
-    x[3] = x[2] + matrix_multiply(f.k[2], u[2]);
-    x[2] = x[1] + matrix_multiply(f.k[1], u[1]);
-    x[1] = x[0] + matrix_multiply(f.k[0], u[0]);
-    x[0] = u[0];
-
-    return u[0] << 5;
+      int32_t u9 = u10 - matrix_multiply(k[9], x9);
+      int32_t u8 = u9 - matrix_multiply(k[8], x8);
+      int32_t u7 = u8 - matrix_multiply(k[7], x7);
+      int32_t u6 = u7 - matrix_multiply(k[6], x6);
+      int32_t u5 = u6 - matrix_multiply(k[5], x5);
+      int32_t u4 = u5 - matrix_multiply(k[4], x4);
+      int32_t u3 = u4 - matrix_multiply(k[3], x3);
+      int32_t u2 = u3 - matrix_multiply(k[2], x2);
+      int32_t u1 = u2 - matrix_multiply(k[1], x1);
+      int32_t u0 = u1 - matrix_multiply(k[0], x0);
+
+      // Output clamp
+      if (u0 > 511) u0 = 511;
+      if (u0 < -512) u0 = -512;
+
+      x9 = x8 + matrix_multiply(k[8], u8);
+      x8 = x7 + matrix_multiply(k[7], u7);
+      x7 = x6 + matrix_multiply(k[6], u6);
+      x6 = x5 + matrix_multiply(k[5], u5);
+      x5 = x4 + matrix_multiply(k[4], u4);
+      x4 = x3 + matrix_multiply(k[3], u3);
+      x3 = x2 + matrix_multiply(k[2], u2);
+      x2 = x1 + matrix_multiply(k[1], u1);
+      x1 = x0 + matrix_multiply(k[0], u0);
+      x0 = u0;
+
+      out[s] = u0 << 5;
+    }
+    x[0] = x0; x[1] = x1; x[2] = x2; x[3] = x3; x[4] = x4;
+    x[5] = x5; x[6] = x6; x[7] = x7; x[8] = x8; x[9] = x9;
+  }
+
+  int16_t Get8kHz() {
+    int16_t ret;
+    Render8kHz(&ret, 1);
+    return ret;
   }
 
 #if 1
@@ -882,15 +908,42 @@ public:
   }
 #endif
   
+  // Same as calling Get44kHz() |elements| times, but renders the
+  // 8kHz samples for each block up front.
   int read(int16_t* data, int elements) override {
-    for (int i = 0; i < elements; i++) {
-      data[i] = Get44kHz();
+    int16_t tmp[16];
+    int32_t a = A, b = B, c = C, d = D;
+    uint32_t pos = l_pos_;
+    for (int done = 0; done < elements;) {
+      int n = elements - done;
+      if (n > 64) n = 64;
+      // A new 8kHz sample goes in every time |pos| passes 11.
+      Render8kHz(tmp, (pos + 2 * n) / 11);
+      const int16_t* next = tmp;
+      for (int i = 0; i < n; i++) {
+        int32_t sum =
+          a * lanc2_11[pos] +
+          b * lanc2_11[pos + 11] +
+          c * lanc2_11[pos + 22] +
+          d * lanc2_11[pos + 33];
+        pos += 2;
+        if (pos >= 11) {
+          pos -= 11;
+          d = c; c = b; b = a;
+          a = *next++;
+        }
+        data[done + i] = clamptoi16(sum >> 14);
+      }
+      done += n;
     }
+    A = a; B = b; C = c; D = d;
+    l_pos_ = pos;
     return elements;
   }
   bool isPlaying() const {
     return !eof();
   }
+  bool IsActive() const override { return isPlaying(); }
   void Stop() override {}
 
   bool Parse(const char *cmd, const char* arg) override {
@@ -933,7 +986,15 @@ public:
     if (rate && arg) {
       const char *start= strchr(arg, '{');
       const char *end = strchr(arg, '}');
-      char *out = const_cast<char*>(arg);
+      // |arg| goes away when we return, so the words are kept in
+      // parsed_ until they have been said.
+      if (!isPlaying()) parsed_bytes_ = 0;
+      if (parsed_bytes_ + strlen(arg) / 2 > sizeof(parsed_)) {
+        STDOUT.println("Talkie busy, try again later.");
+        return true;
+      }
+      uint8_t* data = parsed_ + parsed_bytes_;
+      uint8_t* out = data;
       if (!start) start = arg;
       if (!end) end = arg + strlen(arg);
       int n = 0;
@@ -956,9 +1017,9 @@ public:
           digits = n = 0;
         }
       }
-      Say((uint8_t*)arg, rate);
-      // As soon as we return "arg" will be freed, so let's wait for it.
-      while (isPlaying());
+      parsed_bytes_ = out - parsed_;
+      Say(data, rate);
+      return true;
     }
 
     return false;
@@ -979,8 +1040,20 @@ private:
 
   uint8_t count_ = 0;
   uint8_t pos_ = 0;
-  uint8_t periodCounter;
+  uint8_t periodCounter = 0;
   int32_t x[10];
+  uint16_t synth_rand_ = 1;
+  // 16384 / rate_, 16.16 fixed point.
+  uint32_t lerp_rate_ = 0;
+  uint32_t lerp_step_ = 0;
+
+  Word words_[TALKIE_QUEUE_SIZE];
+  size_t first_word_ = 0;
+  size_t num_words_ = 0;
+
+  // Words from the talkie commands.
+  uint8_t parsed_[256];
+  size_t parsed_bytes_ = 0;
 };
 
 #endif
@@ -4,6 +4,11 @@
 #include <stdlib.h>
 #include <string.h>
 #include <iostream>
+#include <chrono>
+#include <algorithm>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
 
 // junk needed to make this hack work.
 #define digitalWrite(X, Y) ((void)0)
@@ -31,6 +36,8 @@ public:
 };
 STDOUTHELPER STDOUT;
 
+void EnableAmplifier() {}
+
 #include "talkie.h"
 
 CommandParser* parsers = NULL;
@@ -46,7 +53,81 @@ std::string mkchunk(std::string chnk,
   return ret;
 }
 
+uint64_t now_ns() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+uint64_t cycles() {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  return 0;
+#endif
+}
+
+// Says the digits and a couple of error messages. Either one sample
+// at a time with Get44kHz() or in blocks of |block| samples.
+std::vector<int16_t> SayAll(int block) {
+  Talkie talkie;
+  std::vector<int16_t> ret;
+  const uint8_t* digits[] = {
+    spZERO, spONE, spTWO, spTHREE, spFOUR,
+    spFIVE, spSIX, spSEVEN, spEIGHT, spNINE,
+  };
+  for (const uint8_t* digit : digits) talkie.Say(digit);
+  talkie.Say(talkie_low_battery_15, 15);
+  talkie.Say(talkie_sd_card_15, 15);
+  talkie.Say(talkie_not_found_15, 15);
+  while (talkie.isPlaying()) {
+    if (block) {
+      int16_t buf[256];
+      talkie.read(buf, block);
+      ret.insert(ret.end(), buf, buf + block);
+    } else {
+      ret.push_back(talkie.Get44kHz());
+    }
+  }
+  return ret;
+}
+
+uint32_t Hash(const std::vector<int16_t>& samples) {
+  uint32_t h = 2166136261u;
+  for (int16_t s : samples) h = (h ^ (uint16_t)s) * 16777619u;
+  return h;
+}
+
+// What SayAll() produced before the lattice filter was done in blocks.
+const uint32_t kGoldenHash = 0xaf5cdabc;
+
+int bench() {
+  int failed = 0;
+  std::vector<int16_t> golden = SayAll(0);
+  printf("%d samples, hash %08x\n", (int)golden.size(), Hash(golden));
+  if (Hash(golden) != kGoldenHash) {
+    printf("FAIL: output changed\n");
+    failed++;
+  }
+  for (int block : { 0, 1, 7, 44, 256 }) {
+    std::vector<int16_t> out;
+    uint64_t start = now_ns(), start_cycles = cycles();
+    const int rounds = 20;
+    for (int i = 0; i < rounds; i++) out = SayAll(block);
+    double ns = (double)(now_ns() - start) / rounds / out.size();
+    double cy = (double)(cycles() - start_cycles) / rounds / out.size();
+    if (out.size() < golden.size() ||
+        !std::equal(golden.begin(), golden.end(), out.begin())) {
+      printf("FAIL: block %d differs\n", block);
+      failed++;
+    }
+    printf("%s %3d: %.2f ns/sample, %.1f cycles/sample\n",
+           block ? "read() blocks of" : "Get44kHz()      ", block, ns, cy);
+  }
+  return failed;
+}
+
 int main(int argc, char** argv) {
+  if (argc > 1 && !strcmp(argv[1], "bench")) return bench();
   std::string tmp;
   Talkie talkie;
 
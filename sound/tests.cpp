@@ -0,0 +1,2096 @@
+#include <vector>
+#include <chrono>
+#include <thread>
+#include <algorithm>
+#include <string>
+#include <stdint.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <iostream>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// cruft
+template<class A, class B>
+constexpr auto min(A&& a, B&& b) -> decltype(a < b ? std::forward<A>(a) : std::forward<B>(b)) {
+  return a < b ? std::forward<A>(a) : std::forward<B>(b);
+}
+template<class A, class B>
+constexpr auto max(A&& a, B&& b) -> decltype(a < b ? std::forward<A>(a) : std::forward<B>(b)) {
+  return a >= b ? std::forward<A>(a) : std::forward<B>(b);
+}
+#define NELEM(X) (sizeof(X)/sizeof((X)[0]))
+#define AUDIO_RATE 44100
+#define AUDIO_BUFFER_SIZE 44
+#define VOLUME 2200
+
+int32_t clampi32(int32_t x, int32_t a, int32_t b) {
+  if (x < a) return a;
+  if (x > b) return b;
+  return x;
+}
+int16_t clamptoi16(int32_t x) {
+  return clampi32(x, -32768, 32767);
+}
+
+float fract(float x) { return x - floor(x); }
+float clamp(float x, float a, float b) {
+  if (x < a) return a;
+  if (x > b) return b;
+  return x;
+}
+
+uint32_t millis_ = 0;
+uint32_t millis() { return millis_; }
+uint32_t micros_ = 0;
+uint32_t micros() { return micros_; }
+
+class STDOUTHELPER {
+public:
+  template<class F>
+  void print(F foo) {
+    std::cout << foo;
+  }
+  template<class F>
+  void println(F foo) {
+    std::cout << foo << std::endl;
+  }
+};
+STDOUTHELPER STDOUT;
+STDOUTHELPER* default_output = &STDOUT;
+
+#include "../common/monitoring.h"
+Monitoring monitor;
+
+class Looper {
+public:
+  virtual const char* name() = 0;
+  virtual void Loop() = 0;
+};
+
+class ScopedCycleCounter {
+public:
+  explicit ScopedCycleCounter(uint64_t& dest) {}
+};
+uint64_t wav_interrupt_cycles = 0;
+
+// Like on the device, buffer fills run later, when RunPendSV() is called.
+typedef void (*armv7m_pendsv_routine_t)(void*, uint32_t);
+armv7m_pendsv_routine_t pendsv_routine = nullptr;
+bool armv7m_pendsv_enqueue(armv7m_pendsv_routine_t routine,
+                           void* context, uint32_t data) {
+  pendsv_routine = routine;
+  return true;
+}
+void RunPendSV() {
+  armv7m_pendsv_routine_t routine = pendsv_routine;
+  pendsv_routine = nullptr;
+  if (routine) ((void (*)())routine)();
+}
+
+#include "../common/ring_buffer.h"
+#include "../common/histogram.h"
+#include "../common/fat_dir_entry.h"
+#include "audiostream.h"
+#include "dynamic_mixer.h"
+#include "click_avoider_lin.h"
+#include "buffered_audio_stream.h"
+#include "volume_overlay.h"
+#include "../common/sin_table.h"
+#include "crossfade.h"
+#include "swing_curve.h"
+#include "waveform_sampler.h"
+#include "lightsaber_synth.h"
+
+// Host versions of the string helpers in lightsaber.ino.
+int constexpr toLower(char x) {
+  return (x >= 'A' && x <= 'Z') ? x - 'A' + 'a' : x;
+}
+const char *startswith(const char *prefix, const char* x) {
+  while (*prefix) {
+    if (toLower(*x) != toLower(*prefix)) return nullptr;
+    prefix++;
+    x++;
+  }
+  return x;
+}
+bool endswith(const char *postfix, const char* x) {
+  size_t l = strlen(x);
+  if (l < strlen(postfix)) return false;
+  x = x + l - strlen(postfix);
+  while (*postfix) {
+    if (toLower(*x) != toLower(*postfix)) return false;
+    postfix++;
+    x++;
+  }
+  return true;
+}
+char* itoa(int n, char* buf, int base) {
+  sprintf(buf, "%d", n);
+  return buf;
+}
+
+// Host filesystem, standing in for common/lsfs.h.
+#define COMMON_LSFS_H
+#define ENABLE_SD
+#define FONT_PREFETCH_BYTES 65536
+class File {
+public:
+  File() : f_(nullptr) {}
+  explicit File(FILE* f) : f_(f) {}
+  int read(uint8_t* dest, size_t bytes) { return fread(dest, 1, bytes, f_); }
+  size_t write(const uint8_t* data, size_t bytes) {
+    return fwrite(data, 1, bytes, f_);
+  }
+  void seek(size_t pos) { fseek(f_, pos, SEEK_SET); }
+  size_t position() const { return ftell(f_); }
+  size_t size() const {
+    long pos = ftell(f_);
+    fseek(f_, 0, SEEK_END);
+    long ret = ftell(f_);
+    fseek(f_, pos, SEEK_SET);
+    return ret;
+  }
+  size_t available() const { return size() - position(); }
+  int peek() {
+    int c = fgetc(f_);
+    if (c != EOF) ungetc(c, f_);
+    return c;
+  }
+  void close() { if (f_) fclose(f_); f_ = nullptr; }
+  operator bool() const { return f_ != nullptr; }
+private:
+  FILE* f_;
+};
+
+class LSFS {
+public:
+  static bool Exists(const char* path) {
+    struct stat st;
+    return stat(path, &st) == 0;
+  }
+  static File Open(const char* path) {
+    opens()++;
+    return File(fopen(path, "rb"));
+  }
+  // Number of files opened for reading so far.
+  static int& opens() {
+    static int n = 0;
+    return n;
+  }
+  static File OpenForWrite(const char* path) {
+    return File(fopen(path, "wb"));
+  }
+  static bool Remove(const char* path) {
+    return unlink(path) == 0;
+  }
+  class Iterator {
+  public:
+    explicit Iterator(const char* dirname) {
+      path_ = dirname;
+      if (path_.back() != '/') path_ += "/";
+      dir_ = opendir(dirname);
+      ++*this;
+    }
+    explicit Iterator(Iterator& other)
+      : Iterator((other.path_ + other.name()).c_str()) {}
+    ~Iterator() { if (dir_) closedir(dir_); }
+    void operator++() {
+      ent_ = nullptr;
+      while (dir_ && (ent_ = readdir(dir_)) && ent_->d_name[0] == '.');
+      if (ent_) stat((path_ + ent_->d_name).c_str(), &st_);
+    }
+    operator bool() { return ent_ != nullptr; }
+    bool isdir() { return S_ISDIR(st_.st_mode); }
+    const char* name() { return ent_->d_name; }
+    size_t size() { return st_.st_size; }
+  private:
+    std::string path_;
+    DIR* dir_;
+    struct dirent* ent_;
+    struct stat st_;
+  };
+};
+
+class Effect;
+Effect* all_effects = NULL;
+char current_directory[128];
+
+#include "effect.h"
+#include "../common/file_reader.h"
+#include "../common/state_machine.h"
+#include "playwav.h"
+#include "../common/ref.h"
+
+// Only used for printing.
+size_t WhatUnit(class BufferedWavPlayer* player) { return 0; }
+
+#include "buffered_wav_player.h"
+#include "voice_pool.h"
+
+void check(bool ok, const char* what) {
+  if (!ok) {
+    fprintf(stderr, "Test failed: %s\n", what);
+    exit(1);
+  }
+}
+
+void pass() {
+  fprintf(stderr, "PASS\n");
+}
+
+double now_seconds() {
+  return std::chrono::duration<double>(
+    std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Produces a repeating pattern of pseudo-random samples.
+class NoiseStream : public AudioStream {
+public:
+  explicit NoiseStream(int amplitude, uint32_t seed = 1)
+    : amplitude_(amplitude), seed_(seed) {}
+  int read(int16_t* data, int elements) override {
+    for (int i = 0; i < elements; i++) {
+      seed_ = seed_ * 1103515245 + 12345;
+      data[i] = (int32_t)((seed_ >> 16) % (2 * amplitude_ + 1)) - amplitude_;
+    }
+    return elements;
+  }
+private:
+  int amplitude_;
+  uint32_t seed_;
+};
+
+// Plays back a pre-generated table, so that benchmarks measure
+// the consumer rather than the source.
+class TableStream : public AudioStream {
+public:
+  explicit TableStream(uint32_t seed) : table_(4096) {
+    NoiseStream noise(8000, seed);
+    noise.read(table_.data(), table_.size());
+  }
+  int read(int16_t* data, int elements) override {
+    for (int done = 0; done < elements;) {
+      int n = min(elements - done, (int)(table_.size() - pos_));
+      memcpy(data + done, table_.data() + pos_, n * sizeof(data[0]));
+      done += n;
+      pos_ = (pos_ + n) % table_.size();
+    }
+    return elements;
+  }
+private:
+  std::vector<int16_t> table_;
+  size_t pos_ = 0;
+};
+
+class ConstantStream : public AudioStream {
+public:
+  explicit ConstantStream(int16_t value) : value_(value) {}
+  int read(int16_t* data, int elements) override {
+    for (int i = 0; i < elements; i++) data[i] = value_;
+    return elements;
+  }
+private:
+  int16_t value_;
+};
+
+void test_mix_add() {
+  NoiseStream noise(32767, 7);
+  for (int len = 0; len < 40; len++) {
+    int16_t src[40];
+    int32_t sum[40], expected[40];
+    noise.read(src, len);
+    for (int i = 0; i < len; i++) sum[i] = expected[i] = i * 1000 - 20000;
+    for (int i = 0; i < len; i++) expected[i] += src[i];
+    MixAdd(sum, src, len);
+    for (int i = 0; i < len; i++) check(sum[i] == expected[i], "MixAdd");
+  }
+  pass();
+}
+
+void test_mixer_steady_state() {
+  // Constant input should settle at v * volume / (sqrt(255 * v) + 100),
+  // just like the old per-sample compressor.
+  ConstantStream dc(1000);
+  AudioDynamicMixer<9> mixer;
+  mixer.streams_[0] = &dc;
+  int16_t out[44];
+  for (int i = 0; i < 1000; i++) mixer.read(out, NELEM(out));
+  int expected = 1000 * VOLUME / ((int)sqrt(255 * 1000.0) + 100);
+  for (size_t i = 0; i < NELEM(out); i++) {
+    check(abs(out[i] - expected) <= 2, "mixer steady state");
+  }
+  pass();
+}
+
+void test_mixer_clamps() {
+  ConstantStream loud(32767);
+  ConstantStream quiet(-32768);
+  AudioDynamicMixer<9> mixer;
+  for (int i = 0; i < 8; i++) mixer.streams_[i] = &loud;
+  mixer.set_volume(3000);
+  int16_t out[37];
+  for (int i = 0; i < 100; i++) {
+    mixer.read(out, NELEM(out));
+    for (size_t j = 0; j < NELEM(out); j++) check(out[j] >= 0, "positive clamp");
+  }
+  for (int i = 0; i < 8; i++) mixer.streams_[i] = &quiet;
+  AudioStream::Wake();
+  for (int i = 0; i < 100; i++) mixer.read(out, NELEM(out));
+  for (size_t j = 0; j < NELEM(out); j++) check(out[j] < 0, "negative clamp");
+  pass();
+}
+
+// A stream that can be switched on and off, and counts reads.
+class SwitchedStream : public ConstantStream {
+public:
+  explicit SwitchedStream(int16_t value) : ConstantStream(value) {}
+  int read(int16_t* data, int elements) override {
+    reads_++;
+    // Deliberately ignores muted_, so that the test can tell
+    // whether the mixer summed it or not.
+    return ConstantStream::read(data, elements);
+  }
+  bool IsActive() const override { return active_; }
+  bool IsMuted() const override { return muted_; }
+  void Start() { active_ = true; Wake(); }
+  bool active_ = false;
+  bool muted_ = false;
+  int reads_ = 0;
+};
+
+void test_mixer_active_streams() {
+  SwitchedStream a(1000), b(1000);
+  AudioDynamicMixer<9> mixer;
+  mixer.streams_[0] = &a;
+  mixer.streams_[5] = &b;
+  AudioStream::Wake();
+  int16_t out[44];
+  mixer.read(out, NELEM(out));
+  check(a.reads_ == 0 && b.reads_ == 0, "idle streams are not read");
+  check(mixer.active_streams() == 0, "no active streams");
+  for (size_t i = 0; i < NELEM(out); i++) check(out[i] == 0, "silence");
+
+  b.Start();
+  mixer.read(out, NELEM(out));
+  check(a.reads_ == 0 && b.reads_ > 0, "woken stream is read");
+  check(out[NELEM(out) - 1] > 0, "woken stream is summed");
+  check(mixer.active_streams() == 1, "one active stream");
+
+  // Going idle drops the stream from the list without a Wake().
+  b.active_ = false;
+  int reads = b.reads_;
+  mixer.read(out, NELEM(out));
+  check(b.reads_ == reads, "stream dropped when idle");
+  check(mixer.active_streams() == 0, "list empty again");
+
+  // Muted streams are read, but do not contribute to the sum.
+  a.Start();
+  a.muted_ = true;
+  for (int i = 0; i < 100; i++) mixer.read(out, NELEM(out));
+  check(a.reads_ > 0, "muted stream is read");
+  for (size_t i = 0; i < NELEM(out); i++) check(out[i] == 0, "muted stream is not summed");
+  pass();
+}
+
+void test_ring_buffer() {
+  RingBuffer<int16_t, 16> ring;
+  int16_t in[40], out[40];
+  for (int i = 0; i < 40; i++) in[i] = i;
+  check(ring.empty() && ring.space() == 16, "empty ring");
+  check(ring.write(in, 40) == 16, "write stops when full");
+  check(ring.read(out, 5) == 5 && out[4] == 4, "read");
+  check(ring.write(in + 16, 24) == 5, "write wraps");
+  int16_t* span;
+  check(ring.write_span(&span) == 0, "full again");
+  const int16_t* rspan;
+  check(ring.read_span(&rspan) == 11 && rspan[0] == 5, "read span stops at wrap");
+  ring.pop(11);
+  check(ring.read_span(&rspan) == 5 && rspan[4] == 20, "read span after wrap");
+  ring.clear();
+  check(ring.empty(), "clear");
+  pass();
+}
+
+// One thread writes a counting sequence in random-sized chunks,
+// another one reads it back and checks that nothing is lost,
+// duplicated or torn.
+template<class T>
+void ring_stress(size_t total, double* seconds) {
+  static RingBuffer<T, 512> ring;
+  ring.clear();
+  double start = now_seconds();
+  std::thread producer([total]() {
+    uint32_t seed = 1;
+    T buf[300];
+    size_t next = 0;
+    while (next < total) {
+      seed = seed * 1103515245 + 12345;
+      size_t n = min((size_t)(1 + (seed >> 16) % 300), total - next);
+      for (size_t i = 0; i < n; i++) buf[i] = (T)(next + i);
+      size_t done = 0;
+      while (done < n) {
+        size_t written = ring.write(buf + done, n - done);
+        if (!written) std::this_thread::yield();
+        done += written;
+      }
+      next += n;
+    }
+  });
+  uint32_t seed = 7;
+  T buf[300];
+  size_t next = 0;
+  while (next < total) {
+    seed = seed * 1103515245 + 12345;
+    size_t n = 1 + (seed >> 16) % 300;
+    if (seed & 0x10000) {
+      n = ring.read(buf, n);
+    } else {
+      // Exercise the span interface as well.
+      const T* span;
+      n = min(ring.read_span(&span), n);
+      memcpy(buf, span, n * sizeof(T));
+      ring.pop(n);
+    }
+    if (!n) std::this_thread::yield();
+    for (size_t i = 0; i < n; i++) check(buf[i] == (T)(next + i), "ring sequence");
+    next += n;
+  }
+  producer.join();
+  check(ring.empty(), "ring drained");
+  *seconds = now_seconds() - start;
+}
+
+void test_ring_buffer_threads() {
+  double t;
+  ring_stress<int16_t>(2000000, &t);
+  ring_stress<uint32_t>(2000000, &t);
+  pass();
+}
+
+void bench_ring_buffer() {
+  double t;
+  const size_t total = 20000000;
+  ring_stress<int16_t>(total, &t);
+  printf("ring buffer, two threads: %.1f Msamples/s\n", total / t / 1e6);
+  RingBuffer<int16_t, 512> ring;
+  int16_t buf[AUDIO_BUFFER_SIZE] = {};
+  double start = now_seconds();
+  for (size_t i = 0; i < total / AUDIO_BUFFER_SIZE; i++) {
+    ring.write(buf, NELEM(buf));
+    ring.read(buf, NELEM(buf));
+  }
+  t = now_seconds() - start;
+  printf("ring buffer, one thread: %.1f Msamples/s\n", total / t / 1e6);
+}
+
+// Records the order of fills.
+std::vector<int> fill_log;
+
+class MockWork : public AudioStreamWork {
+public:
+  MockWork(int id, int buffered, int chunk)
+    : id_(id), buffered_(buffered), chunk_(chunk) {}
+  int FillBuffer() override {
+    fill_log.push_back(id_);
+    int n = min(chunk_, 512 - buffered_);
+    buffered_ += n;
+    return n;
+  }
+  size_t space_available() const override { return 512 - buffered_; }
+  int buffered() const override { return buffered_; }
+  int id_;
+  int buffered_;
+  int chunk_;
+};
+
+void test_fill_scheduler() {
+  MockWork a(0, 400, 64), b(1, 10, 64), c(2, 200, 64), full(3, 512, 64);
+  fill_log.clear();
+  AudioStreamWork::scheduleFillBuffer();
+  RunPendSV();
+  check(fill_log.size() > 3 && fill_log[0] == 1, "most urgent first");
+  check(std::count(fill_log.begin(), fill_log.end(), 3) == 0, "full stream not filled");
+  for (MockWork* w : { &a, &b, &c }) check(w->buffered_ == 512, "all filled");
+  // b has to catch up with c before c gets any data.
+  size_t first_c = std::find(fill_log.begin(), fill_log.end(), 2) - fill_log.begin();
+  check(first_c == 3, "deadline order");
+
+  // Budget stops the filling early, the rest happens next time.
+  MockWork big[4] = {
+    MockWork(10, 0, 512), MockWork(11, 0, 512),
+    MockWork(12, 0, 512), MockWork(13, 0, 512) };
+  MockWork last(14, 0, 512);
+  fill_log.clear();
+  AudioStreamWork::scheduleFillBuffer();
+  RunPendSV();
+  check(fill_log.size() == AUDIO_FILL_BUDGET / 512, "budget");
+  AudioStreamWork::scheduleFillBuffer();
+  RunPendSV();
+  check(last.buffered_ == 512, "rest filled next time");
+  pass();
+}
+
+// Same as BufferedWavPlayer, minus the wav file.
+class SpanPlayer : public VolumeOverlay<BufferedAudioStream<512> > {
+public:
+  int mix(int32_t* sum, int16_t* scratch, int elements) override {
+    return MixFromBuffer(sum, elements);
+  }
+  void Stop() override { clear(); }
+};
+
+void test_buffered_mix() {
+  NoiseStream src1(20000, 3), src2(20000, 3);
+  SpanPlayer a, b;
+  a.SetStream(&src1);
+  b.SetStream(&src2);
+  int16_t tmp[100];
+  int32_t sum[100];
+  // Odd sizes so that reads straddle the end of the ring buffer.
+  for (int i = 0; i < 200; i++) {
+    int n = 1 + i % 97;
+    if (i == 20) { a.set_volume(3000); b.set_volume(3000); }
+    if (i == 60) { a.set_volume_now(0); b.set_volume_now(0); }
+    if (i == 70) { a.set_volume((int)kMaxVolume); b.set_volume((int)kMaxVolume); }
+    int e = a.read(tmp, n);
+    for (int j = 0; j < n; j++) sum[j] = 7;
+    int m = b.mix(sum, tmp + n, n);
+    RunPendSV();
+    check(e == m, "buffered mix length");
+    for (int j = 0; j < e; j++) check(sum[j] == tmp[j] + 7, "buffered mix == read");
+  }
+  const int16_t* data;
+  int contiguous = a.peek(&data);
+  check(contiguous > 0 && contiguous <= a.buffered(), "peek");
+  pass();
+}
+
+// Finishing a FadeAndStop() in the middle of mix() must leave
+// the ring empty, not with the rest of the span consumed after
+// the clear().
+void test_mix_fade_and_stop() {
+  ConstantStream src(10000);
+  SpanPlayer player;
+  player.SetStream(&src);
+  player.set_speed(kMaxVolume / 100);
+  int16_t tmp[1];
+  player.read(tmp, 1);
+  RunPendSV();
+  player.FadeAndStop();
+  int32_t sum[AUDIO_BUFFER_SIZE];
+  for (int i = 0; i < 10 && player.stopping(); i++) {
+    player.mix(sum, NULL, AUDIO_BUFFER_SIZE);
+  }
+  check(!player.stopping(), "faded out");
+  check(player.buffered() == 0, "empty after stop");
+  pass();
+}
+
+void test_clear_with_fade() {
+  ConstantStream src(10000);
+  SpanPlayer player;
+  player.SetStream(&src);
+  player.set_volume_now((int)kMaxVolume);
+  int16_t tmp[100];
+  player.read(tmp, 1);
+  RunPendSV();
+  check(player.buffered() > SpanPlayer::kFadeOutSamples, "filled");
+  player.clear_with_fade();
+  check(player.buffered() == SpanPlayer::kFadeOutSamples, "tail kept");
+  check(player.read(tmp, 100) == SpanPlayer::kFadeOutSamples, "tail only");
+  check(tmp[0] > 9800 && tmp[SpanPlayer::kFadeOutSamples - 1] < 200,
+        "tail fades out");
+  for (int i = 1; i < SpanPlayer::kFadeOutSamples; i++) {
+    check(tmp[i] <= tmp[i - 1] && tmp[i - 1] - tmp[i] < 200,
+          "smooth fade");
+  }
+
+  // Above full volume the tail clips instead of wrapping around.
+  ConstantStream loud(30000);
+  SpanPlayer boosted;
+  boosted.SetStream(&loud);
+  boosted.set_volume_now((int)kMaxVolume * 2);
+  boosted.read(tmp, 1);
+  RunPendSV();
+  boosted.clear_with_fade();
+  check(boosted.read(tmp, 100) == SpanPlayer::kFadeOutSamples, "loud tail");
+  check(tmp[0] == 32767, "tail clipped");
+  for (int i = 0; i < SpanPlayer::kFadeOutSamples; i++) {
+    check(tmp[i] >= 0, "no wraparound");
+  }
+  pass();
+}
+
+// What VolumeOverlay used to do: step the volume once per sample.
+void PerSampleVolume(int16_t* data, int n, ClickAvoiderLin* v) {
+  for (int i = 0; i < n; i++) {
+    data[i] = clamptoi16((data[i] * (int32_t)v->value()) >> kVolumeShift);
+    v->advance();
+  }
+}
+
+void test_volume_ramp() {
+  NoiseStream src1(20000, 9), src2(20000, 9), ref_src(20000, 9);
+  SpanPlayer a, b;
+  a.SetStream(&src1);
+  b.SetStream(&src2);
+  ClickAvoiderLin ref(kDefaultSpeed);
+  ref.set(kDefaultVolume);
+  ref.set_target(kDefaultVolume);
+  int16_t tmp[100], expected[100];
+  int32_t sum[100];
+  uint32_t seed = 5;
+  for (int i = 0; i < 2000; i++) {
+    int n = 1 + i % 97;
+    if (i % 13 == 0) {
+      seed = seed * 1103515245 + 12345;
+      int vol = (seed >> 16) % (2 * kMaxVolume);
+      if (i % 5 == 0) vol = (seed & 1) ? 0 : kMaxVolume;
+      int speed = 1 + (seed >> 8) % 300;
+      a.set_speed(speed); b.set_speed(speed); ref.set_speed(speed);
+      a.set_volume(vol); b.set_volume(vol); ref.set_target(vol);
+    }
+    int e = a.read(tmp, n);
+    for (int j = 0; j < n; j++) sum[j] = 0;
+    int m = b.mix(sum, tmp + n, n);
+    RunPendSV();
+    check(e == m, "same length");
+    ref_src.read(expected, e);
+    PerSampleVolume(expected, e, &ref);
+    for (int j = 0; j < e; j++) {
+      check(tmp[j] == expected[j], "read ramp == per sample");
+      check(sum[j] == expected[j], "mix ramp == per sample");
+    }
+  }
+  ClickAvoiderLin v(10);
+  v.set(100);
+  v.set_target(135);
+  int32_t step;
+  check(v.ramp(100, &step) == 4 && step == 10, "ramp up");
+  check(v.ramp(2, &step) == 2, "ramp longer than block");
+  v.advance(3);
+  check(v.value() == 130, "advance(n)");
+  v.advance(3);
+  check(v.value() == 135 && v.isConstant(), "stops at target");
+  check(v.ramp(100, &step) == 0, "no ramp when constant");
+  v.set_target(0);
+  check(v.ramp(100, &step) == 14 && step == -10, "ramp down");
+  pass();
+}
+
+// Scales six voices, always ramping, at a constant volume and at
+// full volume, the per-sample way and the block way.
+void bench_volume() {
+  const int voices = 6;
+  static int16_t data[voices][AUDIO_BUFFER_SIZE];
+  for (int v = 0; v < voices; v++) {
+    NoiseStream noise(8000, v + 1);
+    noise.read(data[v], AUDIO_BUFFER_SIZE);
+  }
+  const char* names[] = { "ramp", "constant", "unity" };
+  for (int mode = 0; mode < 3; mode++) {
+    for (int block = 0; block < 2; block++) {
+      ClickAvoiderLin vol[voices];
+      const int blocks = 200000;
+      double start = now_seconds();
+      for (int i = 0; i < blocks; i++) {
+        for (int v = 0; v < voices; v++) {
+          if (mode == 0 && vol[v].isConstant()) {
+            vol[v].set_speed(1);
+            vol[v].set(0);
+            vol[v].set_target(kMaxVolume);
+          }
+          if (mode == 1) vol[v].set(3000), vol[v].set_target(3000);
+          if (mode == 2) vol[v].set(kMaxVolume), vol[v].set_target(kMaxVolume);
+          int16_t* d = data[v];
+          int n = AUDIO_BUFFER_SIZE;
+          if (!block) {
+            PerSampleVolume(d, n, vol + v);
+            continue;
+          }
+          int32_t step;
+          int ramp = vol[v].ramp(n, &step);
+          int32_t mult = vol[v].value();
+          for (int j = 0; j < ramp; j++) {
+            d[j] = clamptoi16((d[j] * mult) >> kVolumeShift);
+            mult += step;
+          }
+          vol[v].advance(ramp);
+          mult = vol[v].value();
+          if (mult != kMaxVolume) {
+            for (int j = ramp; j < n; j++) {
+              d[j] = clamptoi16((d[j] * mult) >> kVolumeShift);
+            }
+          }
+        }
+      }
+      double t = now_seconds() - start;
+      printf("volume %s, %s: %.1f Msamples/s\n", names[mode],
+             block ? "block" : "per sample",
+             blocks * voices * AUDIO_BUFFER_SIZE / t / 1e6);
+    }
+  }
+}
+
+// Compares copying out of the ring buffer with mixing from it.
+void bench_buffered_mix() {
+  for (int span = 0; span < 2; span++) {
+    TableStream src(1);
+    SpanPlayer player;
+    player.SetStream(&src);
+    player.set_volume_now(3000);
+    int16_t tmp[AUDIO_BUFFER_SIZE];
+    int32_t sum[AUDIO_BUFFER_SIZE] = {};
+    const int blocks = 1000000;
+    double start = now_seconds();
+    for (int i = 0; i < blocks; i++) {
+      if (span) {
+        player.mix(sum, tmp, NELEM(tmp));
+      } else {
+        player.AudioStream::mix(sum, tmp, NELEM(tmp));
+      }
+      RunPendSV();
+    }
+    double t = now_seconds() - start;
+    printf("buffered player %s: %.1f Msamples/s\n",
+           span ? "mix" : "read+add", blocks * NELEM(tmp) / t / 1e6);
+  }
+}
+
+void test_histogram() {
+  Log2Histogram h;
+  h.Add(0);
+  h.Add(1);
+  h.Add(2);
+  h.Add(3);
+  h.Add(1000);
+  h.Add(0xffffffff);
+  check(h.bucket(0) == 2 && h.bucket(1) == 2, "small buckets");
+  check(h.bucket(9) == 1 && h.bucket(31) == 1, "large buckets");
+  check(h.count() == 6 && h.max() == 0xffffffff, "count and max");
+  h.Clear();
+  check(h.count() == 0 && h.bucket(0) == 0, "clear");
+  pass();
+}
+
+void test_buffer_stats() {
+  NoiseStream src(1000);
+  SpanPlayer player;
+  int16_t tmp[600];
+  int32_t sum[600] = {};
+  player.SetStream(&src);
+  micros_ = 101;
+  check(player.read(tmp, 44) == 0, "empty at start");
+  check(player.underruns() == 0, "no underrun before first fill");
+  micros_ = 350;
+  RunPendSV();
+  check(player.max_fill_latency_us() == 249, "fill latency");
+  check(player.read(tmp, 100) == 100 && player.underruns() == 0, "normal read");
+  check(player.min_buffered() == 412, "watermark");
+  // No fill in between, so the buffer runs dry.
+  check(player.mix(sum, tmp, 500) == 412 && player.underruns() == 1, "underrun");
+  check(player.min_buffered() == 0, "watermark at zero");
+  RunPendSV();
+  player.ClearStats();
+  check(player.underruns() == 0 && player.min_buffered() == 512, "clear stats");
+  pass();
+}
+
+// Temporary directory for test files.
+std::string test_dir() {
+  static std::string dir;
+  if (dir.empty()) {
+    char tmpl[] = "/tmp/lightsaber_testXXXXXX";
+    dir = mkdtemp(tmpl);
+    dir += "/";
+  }
+  return dir;
+}
+
+void put32(FILE* f, uint32_t x) { fwrite(&x, 4, 1, f); }
+void put16(FILE* f, uint16_t x) { fwrite(&x, 2, 1, f); }
+
+// Writes |samples| (16-bit values, interleaved if stereo)
+// as a PCM wav file with the given format.
+std::string WriteWav(const char* name, int bits, int channels, int rate,
+                     const std::vector<int16_t>& samples) {
+  std::string path = test_dir() + name;
+  FILE* f = fopen(path.c_str(), "wb");
+  uint32_t data_bytes = samples.size() * bits / 8;
+  fwrite("RIFF", 4, 1, f);
+  put32(f, 36 + data_bytes);
+  fwrite("WAVEfmt ", 8, 1, f);
+  put32(f, 16);
+  put16(f, 1);
+  put16(f, channels);
+  put32(f, rate);
+  put32(f, rate * channels * bits / 8);
+  put16(f, channels * bits / 8);
+  put16(f, bits);
+  fwrite("data", 4, 1, f);
+  put32(f, data_bytes);
+  for (int16_t v : samples) {
+    switch (bits) {
+      case 8: fputc((v >> 8) & 0xff, f); break;
+      case 16: put16(f, v); break;
+      case 24: fputc(0, f); put16(f, v); break;
+      case 32: put16(f, 0); put16(f, v); break;
+    }
+  }
+  fclose(f);
+  return path;
+}
+
+std::vector<int16_t> NoiseSamples(size_t n, int amplitude, uint32_t seed) {
+  std::vector<int16_t> ret(n);
+  NoiseStream noise(amplitude, seed);
+  noise.read(ret.data(), n);
+  return ret;
+}
+
+// The linear crossfade that AudioSplicer used to do, for comparison.
+// Like there, |fade| is volatile since it is shared with Play().
+void LinearFade(int16_t* out, const int16_t* in, int n,
+                volatile int* fade, int speed) {
+  for (int i = 0; i < n; i++) {
+    out[i] = (out[i] * *fade + in[i] * (32768 - *fade)) >> 15;
+    if (*fade) {
+      *fade -= speed;
+      if (*fade < 0) *fade = 0;
+    }
+  }
+}
+
+double Rms(const int16_t* data, int n) {
+  double sum = 0.0;
+  for (int i = 0; i < n; i++) sum += data[i] * (double)data[i];
+  return sqrt(sum / n);
+}
+
+void test_crossfade() {
+  const int len = 4410;
+  std::vector<int16_t> a = NoiseSamples(len, 10000, 21);
+  std::vector<int16_t> b = NoiseSamples(len, 10000, 22);
+  double rms = (Rms(a.data(), len) + Rms(b.data(), len)) / 2;
+
+  Crossfade fade;
+  fade.set_length(len);
+  check(fade.done() && fade.remaining() == 0, "not started");
+  fade.Start();
+  check(fade.remaining() == len, "fade length");
+  std::vector<int16_t> equal = a;
+  // Odd block sizes, the result doesn't depend on them.
+  for (int done = 0; done < len;) {
+    int n = min(37, fade.remaining());
+    fade.Apply(equal.data() + done, b.data() + done, n);
+    done += n;
+  }
+  check(fade.done(), "fade done");
+
+  std::vector<int16_t> linear = a;
+  volatile int f = 32768;
+  LinearFade(linear.data(), b.data(), len, &f, 32768 / len + 1);
+
+  check(abs(equal[0] - a[0]) < 3, "starts with the old sound");
+  check(abs(equal[len - 1] - b[len - 1]) < 100, "ends with the new sound");
+  double equal_min = 1e9, linear_min = 1e9;
+  const int window = 441;
+  for (int i = 0; i + window <= len; i += window) {
+    equal_min = min(equal_min, Rms(equal.data() + i, window) / rms);
+    linear_min = min(linear_min, Rms(linear.data() + i, window) / rms);
+  }
+  printf("crossfade: lowest loudness, equal power %.2f, linear %.2f\n",
+         equal_min, linear_min);
+  check(equal_min > 0.9, "equal power keeps the loudness");
+  check(linear_min < 0.8, "linear dips");
+  pass();
+}
+
+void bench_crossfade() {
+  std::vector<int16_t> a = NoiseSamples(4096, 10000, 21);
+  std::vector<int16_t> b = NoiseSamples(4096, 10000, 22);
+  std::vector<int16_t> out(4096);
+  const int rounds = 20000;
+  for (int equal = 0; equal < 2; equal++) {
+    double start = now_seconds();
+    for (int r = 0; r < rounds; r++) {
+      out = a;
+      if (equal) {
+        Crossfade fade;
+        fade.set_length(out.size());
+        fade.Start();
+        for (size_t i = 0; i < out.size(); i += 32) {
+          fade.Apply(out.data() + i, b.data() + i, 32);
+        }
+      } else {
+        volatile int f = 32768;
+        for (size_t i = 0; i < out.size(); i += 32) {
+          LinearFade(out.data() + i, b.data() + i, 32, &f, 8);
+        }
+      }
+    }
+    double t = now_seconds() - start;
+    printf("crossfade %s: %.1f Msamples/s\n", equal ? "equal power" : "linear",
+           rounds * out.size() / t / 1e6);
+  }
+}
+
+// The float math SmoothSwingV2::SB_Motion() used to do, with the
+// default smoothsw.ini values. Returns the A and B player volumes.
+struct SwingVolumes { int a, b; float hum; };
+SwingVolumes FloatSwing(float speed, float begin, float width) {
+  float swing_strength = min(1.0, speed / 450.0);
+  float mixab = 0.0;
+  if (begin < 0.0) mixab = std::max(0.0, std::min(1.0, -begin / (double)width));
+  float mixhum = pow(swing_strength, 1.75);
+  SwingVolumes ret;
+  ret.hum = 1.0 - mixhum * 75.0 / 100.0;
+  mixhum *= 3.0;
+  ret.a = (int)(kDefaultVolume * (mixhum * mixab));
+  ret.b = (int)(kDefaultVolume * (mixhum * (1.0 - mixab)));
+  return ret;
+}
+
+SwingVolumes FixedSwing(const SwingCurve& curve, float speed,
+                        float begin, float inv_width) {
+  int32_t strength = curve.Strength(speed);
+  int32_t mixab = SwingCurve::Transition(begin, inv_width);
+  int32_t mixhum = curve.SwingVolume(strength);
+  SwingVolumes ret;
+  ret.hum = curve.HumVolume(strength) * (1.0f / SwingCurve::kOne);
+  ret.a = (((int64_t)mixhum * mixab) >> SwingCurve::kShift) * kDefaultVolume
+    >> SwingCurve::kShift;
+  ret.b = (((int64_t)mixhum * (SwingCurve::kOne - mixab)) >> SwingCurve::kShift)
+    * kDefaultVolume >> SwingCurve::kShift;
+  return ret;
+}
+
+void test_swing_curve() {
+  SwingCurve curve;
+  curve.Setup(450.0, 1.75, 75.0, 3.0);
+  check(curve.Strength(0) == 0, "no swing");
+  check(curve.Strength(450) == SwingCurve::kOne, "full swing");
+  check(curve.Strength(5000) == SwingCurve::kOne, "clamped");
+  int worst = 0;
+  float worst_hum = 0;
+  uint32_t seed = 3;
+  for (int i = 0; i < 100000; i++) {
+    seed = seed * 1103515245 + 12345;
+    float speed = (seed >> 8) % 60000 / 100.0f;
+    float width = i & 1 ? 45.0f : 160.0f;
+    float begin = ((int)(seed % 4000) - 2000) / 10.0f;
+    SwingVolumes f = FloatSwing(speed, begin, width);
+    SwingVolumes x = FixedSwing(curve, speed, begin, 1.0f / width);
+    worst = max(worst, max(abs(f.a - x.a), abs(f.b - x.b)));
+    worst_hum = max(worst_hum, fabsf(f.hum - x.hum));
+  }
+  printf("swing curve: worst volume error %d / %d, hum %.5f\n",
+         worst, (int)(3 * kDefaultVolume), worst_hum);
+  check(worst <= 8, "swing volumes match float");
+  check(worst_hum < 0.001, "hum volume matches float");
+  pass();
+}
+
+void bench_swing_curve() {
+  SwingCurve curve;
+  curve.Setup(450.0, 1.75, 75.0, 3.0);
+  const int n = 4096;
+  std::vector<float> speeds(n), begins(n);
+  for (int i = 0; i < n; i++) {
+    speeds[i] = (i * 7919) % 600;
+    begins[i] = (i * 104729) % 400 - 200;
+  }
+  const int rounds = 2000;
+  for (int fixed = 0; fixed < 2; fixed++) {
+    int sum = 0;
+    double start = now_seconds();
+    for (int r = 0; r < rounds; r++) {
+      for (int i = 0; i < n; i++) {
+        SwingVolumes v = fixed ?
+          FixedSwing(curve, speeds[i], begins[i], 1.0f / 45.0f) :
+          FloatSwing(speeds[i], begins[i], 45.0f);
+        sum += v.a + v.b;
+      }
+    }
+    double t = now_seconds() - start;
+    printf("swing curve %s: %.1f M updates/s (%d)\n",
+           fixed ? "fixed point" : "float", rounds * n / t / 1e6, sum & 1);
+  }
+}
+
+// LightSaberSynth::read() as it used to be: 16.16 table positions and
+// three divisions per sample.
+struct OldSampler {
+  OldSampler(const int16_t* waveform, int delta)
+    : waveform_(waveform), pos_(0), delta_(delta) {}
+  const int16_t *waveform_;
+  int pos_;
+  int delta_;
+  int16_t next() {
+    pos_ += delta_;
+    if (pos_ >= 1024 * 65536) pos_ -= 1024 * 65536;
+    return waveform_[pos_ >> 16];
+  }
+};
+
+std::vector<int16_t> OldSynth(const LightSaberSynth& synth, int n) {
+  float hz_to_delta = 1024 * 65536.0f / AUDIO_RATE;
+  OldSampler a_hi(sin_table, 137 * 65536 / AUDIO_RATE);
+  OldSampler a_lo(sin_table, 1024 * 65536 / AUDIO_RATE);
+  OldSampler b(sin_table, 300 * 65536 / AUDIO_RATE);
+  OldSampler buzz(synth.buzz_.table_, 35 * hz_to_delta);
+  OldSampler humm_lo(synth.humm_.table_, 90 * hz_to_delta);
+  OldSampler humm_hi(synth.humm_.table_, 98 * hz_to_delta);
+  std::vector<int16_t> ret(n);
+  for (int i = 0; i < n; i++) {
+    int32_t tmp;
+    tmp  = humm_lo.next() * (32768 * 16383 / (3 * 16383 + a_lo.next()));
+    tmp += humm_hi.next() * (32768 * 16383 / (3 * 16383 + a_hi.next()));
+    tmp += buzz.next() * (32768 * 16383 / (3 * 16383 + b.next()));
+    tmp >>= 15;
+    ret[i] = clamptoi16(tmp);
+  }
+  return ret;
+}
+
+// Magnitudes of the first |bins| bins of a Hann windowed DFT.
+std::vector<double> Spectrum(const int16_t* data, int n, int bins) {
+  std::vector<double> ret(bins);
+  for (int k = 0; k < bins; k++) {
+    double re = 0, im = 0;
+    for (int i = 0; i < n; i++) {
+      double w = data[i] * (0.5 - 0.5 * cos(2 * M_PI * i / n));
+      re += w * cos(2 * M_PI * k * i / n);
+      im -= w * sin(2 * M_PI * k * i / n);
+    }
+    ret[k] = sqrt(re * re + im * im);
+  }
+  return ret;
+}
+
+void test_synth() {
+  static LightSaberSynth synth;
+  const int n = 8192;
+  synth.on_ = true;
+  synth.volume_.set(32768);
+  std::vector<int16_t> out(n);
+  // Odd block sizes, the result doesn't depend on them.
+  for (int done = 0; done < n;) {
+    int chunk = min(n - done, 1 + done % 77);
+    synth.read(out.data() + done, chunk);
+    done += chunk;
+  }
+  std::vector<int16_t> old = OldSynth(synth, n);
+  // Up to 2 kHz, which is where all of the hum is.
+  const int bins = 2000 * n / AUDIO_RATE;
+  std::vector<double> a = Spectrum(old.data(), n, bins);
+  std::vector<double> b = Spectrum(out.data(), n, bins);
+  double diff = 0, total = 0;
+  int peak_a = 0, peak_b = 0;
+  for (int k = 0; k < bins; k++) {
+    diff += fabs(a[k] - b[k]);
+    total += a[k];
+    if (a[k] > a[peak_a]) peak_a = k;
+    if (b[k] > b[peak_b]) peak_b = k;
+  }
+  printf("synth: spectral difference %.4f, peak at %.1f Hz\n",
+         diff / total, peak_b * (double)AUDIO_RATE / n);
+  check(peak_a == peak_b, "same peak");
+  check(diff / total < 0.02, "same spectrum");
+
+  synth.on_ = false;
+  synth.read(out.data(), n);
+  check(out[n - 1] == 0, "fades out when off");
+  pass();
+}
+
+void bench_synth() {
+  static LightSaberSynth synth;
+  synth.on_ = true;
+  synth.volume_.set(32768);
+  int16_t tmp[AUDIO_BUFFER_SIZE];
+  const int blocks = 200000;
+  double start = now_seconds();
+  for (int i = 0; i < blocks; i++) synth.read(tmp, NELEM(tmp));
+  double t = now_seconds() - start;
+  printf("synth: %.1f Msamples/s\n", blocks * NELEM(tmp) / t / 1e6);
+  start = now_seconds();
+  int sum = 0;
+  for (int i = 0; i < blocks / 50; i++) sum += OldSynth(synth, 2200)[i % 2200];
+  t = now_seconds() - start;
+  printf("synth, old divisions: %.1f Msamples/s (%d)\n",
+         blocks / 50 * 2200 / t / 1e6, sum & 1);
+}
+
+// Reads everything from |wav|, |chunk| samples at a time.
+std::vector<int16_t> ReadAll(PlayWav* wav, const std::string& path, int chunk) {
+  std::vector<int16_t> ret;
+  wav->Play(path.c_str());
+  std::vector<int16_t> buf(chunk);
+  int empty = 0;
+  while (true) {
+    int n = wav->read(buf.data(), chunk);
+    ret.insert(ret.end(), buf.begin(), buf.begin() + n);
+    if (n) {
+      empty = 0;
+    } else {
+      if (wav->eof() || ++empty > 100) break;
+    }
+  }
+  return ret;
+}
+
+void test_playwav_formats() {
+  PlayWav wav;
+  std::vector<int16_t> mono = NoiseSamples(3001, 30000, 5);
+  for (int chunk : { 1, 7, 44, 256, 4000 }) {
+    std::vector<int16_t> out =
+      ReadAll(&wav, WriteWav("m16.wav", 16, 1, 44100, mono), chunk);
+
+    check(out == mono, "16 bit mono");
+  }
+
+  std::vector<int16_t> out = ReadAll(&wav, WriteWav("m8.wav", 8, 1, 44100, mono), 44);
+  check(out.size() == mono.size(), "8 bit length");
+  for (size_t i = 0; i < out.size(); i++) {
+    check(out[i] == (int16_t)(mono[i] & 0xff00), "8 bit samples");
+  }
+
+  for (int bits : { 24, 32 }) {
+    out = ReadAll(&wav, WriteWav("m24.wav", bits, 1, 44100, mono), 44);
+    check(out == mono, "24/32 bit mono");
+  }
+
+  std::vector<int16_t> stereo = NoiseSamples(3000, 30000, 6);
+  out = ReadAll(&wav, WriteWav("s16.wav", 16, 2, 44100, stereo), 44);
+  check(out.size() == stereo.size() / 2, "stereo length");
+  for (size_t i = 0; i < out.size(); i++) {
+    check(out[i] == (stereo[i * 2] + stereo[i * 2 + 1]) >> 1, "stereo samples");
+  }
+
+  // Every other sample is the input, delayed by one.
+  out = ReadAll(&wav, WriteWav("m22.wav", 16, 1, 22050, mono), 44);
+  check(out.size() == mono.size() * 2, "22kHz length");
+  for (size_t i = 1; i < mono.size(); i++) {
+    check(out[i * 2 + 1] == mono[i - 1], "22kHz samples");
+  }
+  pass();
+}
+
+int AdpcmEncode(ImaAdpcmChannel* state, int sample) {
+  int step = ima_adpcm_steps[state->index()];
+  int diff = sample - state->predictor();
+  int code = 0;
+  if (diff < 0) {
+    code = 8;
+    diff = -diff;
+  }
+  for (int bit = 4; bit; bit >>= 1, step >>= 1) {
+    if (diff >= step) {
+      code |= bit;
+      diff -= step;
+    }
+  }
+  state->Decode(code);
+  return code;
+}
+
+// Writes |samples| as an IMA ADPCM wav file. |decoded| gets what a
+// decoder should produce, interleaved like |samples|.
+std::string WriteAdpcmWav(const char* name, int channels, int block_align,
+                          const std::vector<int16_t>& samples,
+                          std::vector<int16_t>* decoded) {
+  std::string path = test_dir() + name;
+  int per_block = (block_align - 4 * channels) * 2 / channels + 1;
+  size_t frames = samples.size() / channels;
+  size_t blocks = (frames + per_block - 1) / per_block;
+  FILE* f = fopen(path.c_str(), "wb");
+  fwrite("RIFF", 4, 1, f);
+  put32(f, 4 + 28 + 12 + 8 + blocks * block_align);
+  fwrite("WAVEfmt ", 8, 1, f);
+  put32(f, 20);
+  put16(f, 0x11);
+  put16(f, channels);
+  put32(f, 44100);
+  put32(f, 44100 * block_align / per_block);
+  put16(f, block_align);
+  put16(f, 4);
+  put16(f, 2);
+  put16(f, per_block);
+  fwrite("fact", 4, 1, f);
+  put32(f, 4);
+  put32(f, frames);
+  fwrite("data", 4, 1, f);
+  put32(f, blocks * block_align);
+  decoded->clear();
+  ImaAdpcmChannel state[2];
+  auto sample = [&](size_t frame, int c) {
+    return frame < frames ? samples[frame * channels + c] : 0;
+  };
+  for (size_t b = 0; b < blocks; b++) {
+    size_t frame = b * per_block;
+    for (int c = 0; c < channels; c++) {
+      unsigned char header[4] = {
+        (unsigned char)sample(frame, c),
+        (unsigned char)(sample(frame, c) >> 8),
+        (unsigned char)state[c].index(), 0 };
+      state[c].Start(header);
+      fwrite(header, 4, 1, f);
+      decoded->push_back(sample(frame, c));
+    }
+    frame++;
+    for (int group = 0; group < (per_block - 1) / 8; group++, frame += 8) {
+      int16_t out[2][8];
+      for (int c = 0; c < channels; c++) {
+        for (int i = 0; i < 8; i += 2) {
+          int lo = AdpcmEncode(state + c, sample(frame + i, c));
+          out[c][i] = state[c].predictor();
+          int hi = AdpcmEncode(state + c, sample(frame + i + 1, c));
+          out[c][i + 1] = state[c].predictor();
+          fputc(lo | (hi << 4), f);
+        }
+      }
+      for (int i = 0; i < 8; i++)
+        for (int c = 0; c < channels; c++)
+          decoded->push_back(out[c][i]);
+    }
+  }
+  fclose(f);
+  return path;
+}
+
+// Resamples a |freq| Hz sine at |rate| and returns the largest
+// difference from the same sine at AUDIO_RATE, ignoring the edges.
+int ResampleError(uint32_t rate, double freq, int amplitude, int expected) {
+  Resampler r;
+  r.SetRate(rate);
+  int err = 0;
+  size_t j = 0;
+  for (size_t i = 0; i < rate / 10; i++) {
+    r.Put(amplitude * sin(2 * M_PI * freq * i / rate));
+    int16_t out;
+    while (r.Get(&out)) {
+      if (j > 100) {
+        int want = expected * sin(2 * M_PI * freq * j / AUDIO_RATE);
+        err = max(err, abs(out - want));
+      }
+      j++;
+    }
+  }
+  check(abs((int)j - AUDIO_RATE / 10) < 100, "resampled length");
+  return err;
+}
+
+void test_resampler() {
+  for (uint32_t rate : { 8000, 32000, 48000, 88200, 96000, 176400 }) {
+    check(ResampleError(rate, 1000, 16000, 16000) < 100, "resampled sine");
+  }
+  // Above the output nyquist frequency, should be filtered out.
+  check(ResampleError(96000, 30000, 16000, 0) < 50, "aliasing");
+  check(ResampleError(88200, 27000, 16000, 0) < 50, "aliasing 2:1");
+  check(!Resampler::Supported(7999), "low rate");
+  check(!Resampler::Supported(AUDIO_RATE * 4 + 1), "high rate");
+
+  PlayWav wav;
+  std::vector<int16_t> dc(4800, 10000);
+  for (int chunk : { 1, 44, 4000 }) {
+    std::vector<int16_t> out =
+      ReadAll(&wav, WriteWav("m48.wav", 16, 1, 48000, dc), chunk);
+    check(abs((int)out.size() - 4410) < 10, "48kHz length");
+    for (size_t i = 20; i < out.size() - 20; i++) {
+      check(abs(out[i] - 10000) < 10, "48kHz samples");
+    }
+  }
+  // Same rate as the last file, nothing from it may leak in.
+  std::vector<int16_t> silence(4800, 0);
+  std::vector<int16_t> out =
+    ReadAll(&wav, WriteWav("s48.wav", 16, 1, 48000, silence), 44);
+  for (int16_t x : out) check(x == 0, "resampler history reset");
+  pass();
+}
+
+void test_adpcm() {
+  PlayWav wav;
+  std::vector<int16_t> decoded;
+  std::vector<int16_t> mono(2041 * 3);
+  for (size_t i = 0; i < mono.size(); i++)
+    mono[i] = 10000 * sin(i * 0.05) + (i * 7919 % 1000) - 500;
+  for (int chunk : { 1, 44, 4000 }) {
+    std::vector<int16_t> out = ReadAll(
+      &wav, WriteAdpcmWav("a1.wav", 1, 1024, mono, &decoded), chunk);
+    check(out == decoded, "adpcm mono");
+  }
+  int err = 0;
+  for (size_t i = 100; i < mono.size(); i++)
+    err = max(err, abs(decoded[i] - mono[i]));
+  check(err < 1000, "adpcm round trip");
+
+  std::vector<int16_t> stereo = NoiseSamples(505 * 2 * 4, 2000, 8);
+  std::vector<int16_t> out =
+    ReadAll(&wav, WriteAdpcmWav("a2.wav", 2, 512, stereo, &decoded), 44);
+  check(out.size() == decoded.size() / 2, "adpcm stereo length");
+  for (size_t i = 0; i < out.size(); i++) {
+    check(out[i] == (decoded[i * 2] + decoded[i * 2 + 1]) >> 1,
+          "adpcm stereo");
+  }
+  pass();
+}
+
+void test_wav_header_cache() {
+  std::string font = test_dir() + "font/";
+  mkdir(font.c_str(), 0700);
+  std::vector<int16_t> mono = NoiseSamples(1000, 30000, 9);
+  std::vector<int16_t> decoded;
+  WriteWav("font/clash1.wav", 16, 1, 44100, mono);
+  WriteAdpcmWav("font/clash2.wav", 1, 256, mono, &decoded);
+  FILE* f = fopen((font + "clash3.wav").c_str(), "wb");
+  fputs("not a wav file", f);
+  fclose(f);
+
+  Effect clash("clash");
+  strcpy(current_directory, font.c_str());
+  Effect::ScanDirectory(font.c_str());
+  check(clash.files_found() == 3, "files found");
+  const WavHeader* h = clash.GetWavHeader(0);
+  check(h && h->data_offset == 44 && h->data_bytes == 2000 &&
+        h->rate == 44100 && h->channels == 1 && h->bits == 16, "pcm header");
+  h = clash.GetWavHeader(1);
+  check(h && h->data_offset == 60 && h->bits == 4 && h->block_align == 256,
+        "adpcm header");
+  check(!clash.GetWavHeader(2), "bad header");
+
+  // With the header cached, PlayWav seeks straight to the samples and
+  // never looks at the RIFF header again.
+  f = fopen((font + "clash1.wav").c_str(), "r+b");
+  fputs("JUNK", f);
+  fclose(f);
+  PlayWav wav;
+  clash.Select(0);
+  wav.PlayOnce(&clash);
+  std::vector<int16_t> out, buf(100);
+  while (!wav.eof()) {
+    int n = wav.read(buf.data(), buf.size());
+    out.insert(out.end(), buf.begin(), buf.begin() + n);
+  }
+  check(out == mono, "cached play");
+
+  // ADPCM seeks to the start of a block, and the block headers
+  // don't count as samples.
+  const int per_block = 505;
+  clash.Select(1);
+  wav.PlayAt(clash.RandomFile(), 600.0f / 44100);
+  out.clear();
+  while (!wav.eof()) {
+    int n = wav.read(buf.data(), buf.size());
+    if (out.empty() && n) {
+      check(fabsf(wav.position() - (per_block + n) / 44100.0f) < 1e-6,
+            "adpcm position");
+    }
+    out.insert(out.end(), buf.begin(), buf.begin() + n);
+  }
+  check(fabsf(wav.length() - 2 * per_block / 44100.0f) < 1e-6,
+        "adpcm length");
+  check(out == std::vector<int16_t>(decoded.begin() + per_block,
+                                    decoded.end()), "adpcm seek");
+  all_effects = nullptr;
+  pass();
+}
+
+// The same effect and file number is a different file after a
+// font change, so it can't reuse the file that is still open.
+void test_font_change_reopens() {
+  std::vector<int16_t> a = NoiseSamples(500, 30000, 10);
+  std::vector<int16_t> b = NoiseSamples(500, 30000, 11);
+  mkdir((test_dir() + "fonta").c_str(), 0700);
+  mkdir((test_dir() + "fontb").c_str(), 0700);
+  WriteWav("fonta/clash.wav", 16, 1, 44100, a);
+  WriteWav("fontb/clash.wav", 16, 1, 44100, b);
+  Effect clash("clash");
+  PlayWav wav;
+  std::vector<int16_t> buf(100);
+  for (const char* font : { "fonta/", "fontb/" }) {
+    std::string dir = test_dir() + font;
+    strcpy(current_directory, dir.c_str());
+    Effect::ScanDirectory(dir.c_str());
+    wav.PlayOnce(&clash);
+    std::vector<int16_t> out;
+    while (!wav.eof()) {
+      int n = wav.read(buf.data(), buf.size());
+      out.insert(out.end(), buf.begin(), buf.begin() + n);
+    }
+    check(out == (font[4] == 'a' ? a : b), "file from the current font");
+  }
+  all_effects = nullptr;
+  pass();
+}
+
+// SmoothSwingV2 picks the next swing pair by selecting it while the
+// current pair keeps looping. The switch has to happen where the file
+// loops, with no samples lost, no seek, and no file opened at select
+// time.
+void test_swing_pair_switch() {
+  std::string font = test_dir() + "swings/";
+  mkdir(font.c_str(), 0700);
+  std::vector<int16_t> one = NoiseSamples(3000, 20000, 31);
+  std::vector<int16_t> two = NoiseSamples(2000, 20000, 32);
+  WriteWav("swings/swingl1.wav", 16, 1, 44100, one);
+  WriteWav("swings/swingl2.wav", 16, 1, 44100, two);
+  Effect swingl("swingl");
+  strcpy(current_directory, font.c_str());
+  Effect::ScanDirectory(font.c_str());
+  check(swingl.files_found() == 2, "swings found");
+
+  PlayWav wav;
+  swingl.Select(0);
+  wav.PlayOnce(&swingl);
+  wav.PlayLoop(&swingl);
+  std::vector<int16_t> out, buf(77);
+  while (out.size() < 1000) {
+    int n = wav.read(buf.data(), buf.size());
+    out.insert(out.end(), buf.begin(), buf.begin() + n);
+  }
+  int opens = LSFS::opens();
+  swingl.Select(1);
+  check(LSFS::opens() == opens, "nothing opened on select");
+  for (int i = 0; i < 1000 && out.size() < one.size() + two.size() * 2; i++) {
+    int n = wav.read(buf.data(), buf.size());
+    out.insert(out.end(), buf.begin(), buf.begin() + n);
+  }
+  check(std::equal(one.begin(), one.end(), out.begin()), "old pair to the end");
+  check(std::equal(two.begin(), two.end(), out.begin() + one.size()),
+        "new pair from the start");
+  check(std::equal(two.begin(), two.begin() + 500,
+                   out.begin() + one.size() + two.size()),
+        "new pair loops");
+  check(LSFS::opens() == opens + 1, "one open, at the loop");
+  wav.Stop();
+  all_effects = nullptr;
+  pass();
+}
+
+// Reads until eof, |chunk| samples at a time.
+std::vector<int16_t> ReadToEnd(PlayWav* wav, int chunk) {
+  std::vector<int16_t> ret, buf(chunk);
+  while (!wav->eof()) {
+    int n = wav->read(buf.data(), chunk);
+    ret.insert(ret.end(), buf.begin(), buf.begin() + n);
+  }
+  return ret;
+}
+
+void test_preload() {
+  std::string font = test_dir() + "preload/";
+  mkdir(font.c_str(), 0700);
+  std::vector<int16_t> mono = NoiseSamples(2000, 30000, 10);
+  std::vector<int16_t> stereo = NoiseSamples(505 * 2 * 3, 2000, 11);
+  std::vector<int16_t> decoded;
+  WriteWav("preload/blst1.wav", 16, 1, 44100, mono);
+  WriteAdpcmWav("preload/blst2.wav", 2, 512, stereo, &decoded);
+
+  Effect blst("blst", true), hum("hum");
+  WriteWav("preload/hum.wav", 16, 1, 44100, mono);
+  strcpy(current_directory, font.c_str());
+  Effect::ScanDirectory(font.c_str());
+  const WavHeader* h = blst.GetWavHeader(0);
+  int bytes = 44100 * AUDIO_PRELOAD_MS / 1000 * 2;
+  check(h && h->preload_offset == 0 && h->preload_bytes == bytes,
+        "pcm preload");
+  h = blst.GetWavHeader(1);
+  check(h && h->preload_offset == bytes && h->preload_bytes % 8 == 0 &&
+        h->preload_bytes > 0, "adpcm preload");
+  check(!hum.GetWavHeader(0)->preload_bytes, "no preload");
+
+  // Overwrite the start of the sample data on "disk", playback
+  // should still get it from RAM.
+  for (const char* name : { "blst1.wav", "blst2.wav" }) {
+    FILE* f = fopen((font + name).c_str(), "r+b");
+    fseek(f, name[4] == '1' ? 44 : 60, SEEK_SET);
+    for (int i = 0; i < 100; i++) fputc(0x55, f);
+    fclose(f);
+  }
+  PlayWav wav;
+  for (int chunk : { 1, 44, 4000 }) {
+    blst.Select(0);
+    wav.PlayOnce(&blst);
+    check(ReadToEnd(&wav, chunk) == mono, "preloaded pcm");
+
+    blst.Select(1);
+    wav.PlayOnce(&blst);
+    std::vector<int16_t> out = ReadToEnd(&wav, chunk);
+    check(out.size() == decoded.size() / 2, "preloaded adpcm length");
+    for (size_t i = 0; i < out.size(); i++) {
+      check(out[i] == (decoded[i * 2] + decoded[i * 2 + 1]) >> 1,
+            "preloaded adpcm");
+    }
+  }
+
+  // Starting in the middle doesn't use the preloaded part.
+  blst.Select(0);
+  wav.PlayOnce(&blst, 1000.0 / 44100);
+  std::vector<int16_t> out = ReadToEnd(&wav, 44);
+  check(std::vector<int16_t>(mono.begin() + 1000, mono.end()) == out,
+        "start offset");
+  all_effects = nullptr;
+  pass();
+}
+
+#define TEST_EFFECTS(X) X(boot) X(swing) X(hum) X(poweron) X(poweroff) \
+  X(pwroff) X(clash) X(force) X(stab) X(blaster) X(lockup) X(poweronf) \
+  X(font) X(blst) X(clsh) X(in) X(out) X(lock) X(swng) X(slsh) X(swingl) \
+  X(swingh) X(drag)
+#define DECLARE_EFFECT(X) Effect X(#X);
+#define LIST_EFFECT(X) &X,
+#define EFFECT_NAME(X) #X,
+
+// A font with every kind of effect, mostly numbered files, some in
+// subdirectories, some not matching anything.
+std::vector<std::string> FontFileNames(size_t n) {
+  const char* effects[] = { TEST_EFFECTS(EFFECT_NAME) };
+  std::vector<std::string> ret;
+  char name[64];
+  for (size_t i = 0; ret.size() < n; i++) {
+    const char* e = effects[i % NELEM(effects)];
+    int num = i / NELEM(effects) + 1;
+    switch (i % 7) {
+      case 0: snprintf(name, sizeof(name), "%s.wav", e); break;
+      case 1: snprintf(name, sizeof(name), "%s/%s%02d.wav", e, e, num); break;
+      case 2: snprintf(name, sizeof(name), "readme%d.txt", num); break;
+      case 3: snprintf(name, sizeof(name), "%sX%d.wav", e, num); break;
+      default: snprintf(name, sizeof(name), "%s%d.wav", e, num); break;
+    }
+    ret.push_back(name);
+  }
+  return ret;
+}
+
+void test_effect_trie() {
+  TEST_EFFECTS(DECLARE_EFFECT);
+  std::vector<Effect*> effects = { TEST_EFFECTS(LIST_EFFECT) };
+  std::vector<std::string> files = FontFileNames(500);
+  files.push_back("LOCKUP7.WAV");
+  files.push_back("lock/lockup3.wav");
+  std::vector<size_t> found;
+  for (Effect* e : effects) {
+    e->reset();
+    for (const std::string& f : files)
+      if (Effect::IdentifyExtension(f.c_str()) != Effect::UNKNOWN)
+        e->Scan(f.c_str());
+    found.push_back(e->files_found());
+  }
+  for (Effect* e : effects) e->reset();
+  for (const std::string& f : files) Effect::ScanAll(f.c_str());
+  for (size_t i = 0; i < effects.size(); i++) {
+    check(effects[i]->files_found() == found[i], "trie scan");
+  }
+  all_effects = nullptr;
+  pass();
+}
+
+void bench_effect_scan() {
+  TEST_EFFECTS(DECLARE_EFFECT);
+  std::vector<Effect*> effects = { TEST_EFFECTS(LIST_EFFECT) };
+  std::vector<std::string> files = FontFileNames(2000);
+  const int kRounds = 100;
+  double start = now_seconds();
+  for (int r = 0; r < kRounds; r++) {
+    for (const std::string& f : files) {
+      if (Effect::IdentifyExtension(f.c_str()) == Effect::UNKNOWN) continue;
+      for (Effect* e : effects) e->Scan(f.c_str());
+    }
+  }
+  double linear = now_seconds() - start;
+  start = now_seconds();
+  for (int r = 0; r < kRounds; r++) {
+    for (const std::string& f : files) Effect::ScanAll(f.c_str());
+  }
+  double trie = now_seconds() - start;
+  printf("scan 2000 files: every effect %.1f us, trie %.1f us\n",
+         linear * 1e6 / kRounds, trie * 1e6 / kRounds);
+  all_effects = nullptr;
+}
+
+void test_fat_dir_entry() {
+  auto make = [](const char* name83, uint8_t attr, uint32_t cluster, uint32_t size) {
+    std::vector<uint8_t> e(FatDirEntry::kSize, 0);
+    memcpy(e.data(), name83, 11);
+    e[11] = attr;
+    e[20] = cluster >> 16; e[21] = cluster >> 24;
+    e[26] = cluster; e[27] = cluster >> 8;
+    e[28] = size; e[29] = size >> 8; e[30] = size >> 16; e[31] = size >> 24;
+    return e;
+  };
+  FatDirEntry entry;
+  check(entry.Parse(make("HUM     WAV", 0x20, 0x12345, 70000).data()) == FatDirEntry::ENTRY, "file");
+  check(!strcmp(entry.name(), "HUM.WAV"), "file name");
+  check(entry.size() == 70000, "file size");
+  check(entry.cluster() == 0x12345, "file cluster");
+  check(!entry.isdir(), "file is not a dir");
+
+  check(entry.Parse(make("CLSH       ", FatDirEntry::ATTR_DIRECTORY, 7, 0).data()) == FatDirEntry::ENTRY, "dir");
+  check(!strcmp(entry.name(), "CLSH"), "dir name");
+  check(entry.isdir(), "dir is a dir");
+
+  check(entry.Parse(make("\x05" "BC     TXT", 0x20, 3, 1).data()) == FatDirEntry::ENTRY, "kanji");
+  check((uint8_t)entry.name()[0] == 0xE5, "0x05 escape");
+
+  check(entry.Parse(make("\xE5UM     WAV", 0x20, 3, 1).data()) == FatDirEntry::SKIP, "deleted");
+  check(entry.Parse(make(".          ", FatDirEntry::ATTR_DIRECTORY, 3, 0).data()) == FatDirEntry::SKIP, "dot");
+  check(entry.Parse(make("..         ", FatDirEntry::ATTR_DIRECTORY, 0, 0).data()) == FatDirEntry::SKIP, "dotdot");
+  check(entry.Parse(make("Ah\0u\0m\0\0\0\0", FatDirEntry::ATTR_LONG_NAME, 0, 0).data()) == FatDirEntry::SKIP, "long name");
+  check(entry.Parse(make("SABER      ", FatDirEntry::ATTR_VOLUME_ID, 0, 0).data()) == FatDirEntry::SKIP, "volume label");
+  check(entry.Parse(make("\0          ", 0, 0, 0).data()) == FatDirEntry::END, "end");
+}
+
+// Floods the players with clashes and blasts, like a very busy duel.
+void test_voice_pool() {
+  std::string font = test_dir() + "voices/";
+  mkdir(font.c_str(), 0700);
+  WriteWav("voices/hum.wav", 16, 1, 44100, NoiseSamples(44100, 10000, 1));
+  WriteWav("voices/blst.wav", 16, 1, 44100, NoiseSamples(20000, 20000, 2));
+  WriteWav("voices/clsh.wav", 16, 1, 44100, NoiseSamples(20000, 20000, 3));
+  WriteWav("voices/swng.wav", 16, 1, 44100, NoiseSamples(20000, 20000, 4));
+  Effect hum("hum"), blst("blst"), clsh("clsh"), swng("swng");
+  strcpy(current_directory, font.c_str());
+  Effect::ScanDirectory(font.c_str());
+
+  BufferedWavPlayer players[6];
+  VoicePool<BufferedWavPlayer, NELEM(players)> pool(players);
+  int32_t sum[AUDIO_BUFFER_SIZE];
+  int16_t scratch[AUDIO_BUFFER_SIZE];
+  auto mix = [&]() {
+    for (BufferedWavPlayer& p : players) p.mix(sum, scratch, NELEM(sum));
+    RunPendSV();
+  };
+
+  RefPtr<BufferedWavPlayer> hum_player = pool.Get(VOICE_HIGH);
+  hum_player->PlayOnce(&hum);
+  hum_player->PlayLoop(&hum);
+
+  double slowest = 0.0;
+  for (int i = 0; i < 300; i++) {
+    double start = now_seconds();
+    RefPtr<BufferedWavPlayer> p = pool.Get(i % 3 ? VOICE_NORMAL : VOICE_LOW);
+    slowest = max(slowest, now_seconds() - start);
+    if (p) p->PlayOnce(i % 3 ? (i % 2 ? &blst : &clsh) : &swng);
+    // Swings may find nothing to steal, everything else must play.
+    check(p || i % 3 == 0, "clash or blast dropped");
+    if (i % 4 == 0) mix();
+  }
+  printf("voice pool: slowest allocation %.1f us, %d steals\n",
+         slowest * 1e6, (int)pool.steals());
+  check(slowest < 0.002, "allocation stalled");
+  check(pool.steals() > 150, "voices stolen");
+  check(hum_player->isPlaying() && hum_player->refs() == 1, "hum kept");
+
+  // Oldest of the lowest priority goes first.
+  for (BufferedWavPlayer& p : players) if (!p.refs()) p.Stop();
+  BufferedWavPlayer* order[5];
+  for (int i = 0; i < 5; i++) {
+    RefPtr<BufferedWavPlayer> p = pool.Get(i == 3 ? VOICE_LOW : VOICE_NORMAL);
+    order[i] = p.get();
+    p->PlayOnce(&clsh);
+    mix();
+  }
+  check(pool.Get(VOICE_LOW).get() == order[3], "low steals low");
+  check(pool.Get(VOICE_NORMAL).get() == order[3], "lowest priority first");
+  check(!pool.Get(VOICE_LOW), "low can't steal normal");
+  check(pool.Get(VOICE_NORMAL).get() == order[0], "then the oldest");
+  for (int i = 0; i < 5; i++) order[i]->Stop();
+
+  // An idle voice starts right away, a stolen one fades out at its
+  // old volume before the next sound.
+  std::vector<int16_t> clash_samples = NoiseSamples(20000, 20000, 3);
+  BufferedWavPlayer solo[1];
+  VoicePool<BufferedWavPlayer, 1> one(solo);
+  int16_t out[AUDIO_BUFFER_SIZE];
+  RefPtr<BufferedWavPlayer> v = one.Get();
+  v->set_volume_now((int)kMaxVolume);
+  v->PlayOnce(&clsh);
+  // Opening the file takes a few passes.
+  for (int i = 0; i < 5; i++) {
+    AudioStreamWork::scheduleFillBuffer();
+    RunPendSV();
+  }
+  check(v->read(out, NELEM(out)) == NELEM(out) && out[0] == clash_samples[0],
+        "no fade before an idle voice");
+  v->set_volume_now((int)kMaxVolume / 4);
+  v.Free();
+  v = one.Get();
+  check(one.steals() == 1 && v->faded_tail() == SpanPlayer::kFadeOutSamples,
+        "stolen");
+  check(v->volume() == 0.5f, "volume reset");
+  int32_t expected = ((int32_t)clash_samples[NELEM(out)] * 64 / 65 *
+                      ((int)kMaxVolume / 4)) >> kVolumeShift;
+  check(v->read(out, NELEM(out)) == NELEM(out) && out[0] == expected,
+        "tail at the old volume");
+  v->Stop();
+  all_effects = nullptr;
+  pass();
+}
+
+// A muted loop stops reading after VOICE_VIRTUALIZE_MS, and picks up
+// where it would have been when it's turned up again.
+void test_virtual_voice() {
+  std::string font = test_dir() + "virtual/";
+  mkdir(font.c_str(), 0700);
+  std::vector<int16_t> samples = NoiseSamples(10000, 20000, 41);
+  WriteWav("virtual/hum.wav", 16, 1, 44100, samples);
+  Effect hum("hum");
+  strcpy(current_directory, font.c_str());
+  Effect::ScanDirectory(font.c_str());
+
+  BufferedWavPlayer player;
+  int elapsed = 0;
+  std::vector<int16_t> out;
+  // Same as DynamicMixer: muted streams are read, the rest are mixed.
+  // |elapsed| counts the samples the player has moved on by.
+  auto run = [&](int samples) {
+    for (int done = 0; done < samples; done += 44) {
+      int16_t tmp[44];
+      int32_t sum[44] = {};
+      int n;
+      if (player.IsMuted()) {
+        n = player.read(tmp, NELEM(tmp));
+      } else {
+        n = player.mix(sum, tmp, NELEM(tmp));
+        out.insert(out.end(), sum, sum + n);
+      }
+      elapsed += n;
+      RunPendSV();
+    }
+  };
+  player.set_volume_now((int)kMaxVolume);
+  player.PlayOnce(&hum);
+  player.PlayLoop(&hum);
+  run(4400);
+  check(std::equal(out.begin(), out.end(), samples.begin()), "plays");
+
+  player.set_volume_now(0);
+  run(44 * VOICE_VIRTUALIZE_MS + 440);
+  check(player.isVirtual() && player.isPlaying(), "virtual");
+  int opens = LSFS::opens();
+  size_t buffered = player.buffered();
+  run(44100);
+  check(player.buffered() == (int)buffered, "nothing read while virtual");
+
+  int expected = elapsed % samples.size();
+  player.set_volume((int)kMaxVolume);
+  check(!player.isVirtual(), "resumed");
+  check(LSFS::opens() == opens, "same file, no open");
+  out.clear();
+  run(4400);
+  check(abs(out[0]) < 1000, "fades in");
+  // Find where it picked up, it should be within a block.
+  int found = -1;
+  check(out.size() > 4000, "playing again");
+  for (int i = 0; i + 3600 <= (int)samples.size() && found < 0; i++) {
+    if (std::equal(out.begin() + 400, out.begin() + 4000,
+                   samples.begin() + i)) {
+      found = i - 400;
+    }
+  }
+  printf("virtual voice: resumed at %d, expected %d\n", found, expected);
+  check(found >= 0 && abs(found - expected) <= 44, "resumed in step");
+
+  // Prepare() brings it back while it is still muted, and keeps it
+  // from going virtual as long as it is called.
+  player.set_volume_now(0);
+  run(44 * VOICE_VIRTUALIZE_MS + 440);
+  check(player.isVirtual(), "virtual again");
+  player.Prepare();
+  check(!player.isVirtual(), "prepared");
+  for (int i = 0; i < 6; i++) {
+    run(44 * VOICE_VIRTUALIZE_MS / 2);
+    player.Prepare();
+  }
+  check(!player.isVirtual() && player.buffered() > 0, "stays prepared");
+  opens = LSFS::opens();
+  player.set_volume((int)kMaxVolume);
+  check(LSFS::opens() == opens, "nothing to reopen");
+  out.clear();
+  run(4400);
+  check(out.size() == 4400 && out[4399] != 0, "plays after prepare");
+
+  // Players can also opt out, and keep their file and buffer.
+  player.set_virtualize(false);
+  player.set_volume_now(0);
+  run(44 * VOICE_VIRTUALIZE_MS * 3);
+  check(!player.isVirtual() && player.buffered() > 0, "not virtualized");
+  player.reset_volume();
+  player.set_volume_now(0);
+  run(44 * VOICE_VIRTUALIZE_MS + 440);
+  check(player.isVirtual(), "reset_volume() allows it again");
+  player.Stop();
+  all_effects = nullptr;
+  pass();
+}
+
+// Loading a font a step at a time must give the same result as
+// ScanDirectory(), opening one file per step.
+void test_scan_steps() {
+  std::string font = test_dir() + "steps/";
+  mkdir(font.c_str(), 0700);
+  std::vector<int16_t> mono = NoiseSamples(2000, 30000, 13);
+  WriteWav("steps/hum.wav", 16, 1, 44100, mono);
+  WriteWav("steps/blst.wav", 16, 1, 22050, mono);
+  for (const char* name : { "steps/clsh1.wav", "steps/clsh2.wav",
+                            "steps/clsh3.wav" }) {
+    WriteWav(name, 16, 2, 44100, mono);
+  }
+  Effect hum("hum"), clsh("clsh", true), blst("blst"), swng("swng");
+  strcpy(current_directory, font.c_str());
+
+  // Looking for the index, five headers, then the index is written a
+  // chunk at a time.
+  std::string index = font + FONT_INDEX_NAME;
+  Effect::BeginScan(font.c_str());
+  int steps = 0;
+  for (int opens = LSFS::opens(); Effect::ScanStep(); opens = LSFS::opens()) {
+    check(LSFS::opens() - opens <= 1, "one file per step");
+    steps++;
+  }
+  check(!Effect::ScanStep(), "done stays done");
+  check(hum.GetWavHeader(0)->rate == 44100, "hum header");
+  check(blst.GetWavHeader(0)->rate == 22050, "blst header");
+  check(clsh.GetWavHeader(2)->channels == 2, "clsh header");
+  check(clsh.GetWavHeader(2)->preload_bytes > 0, "clsh preload");
+  check(!swng.files_found(), "no swings");
+  // The headers and the preloaded data are separate chunks.
+  const Effect::IndexHeader& h = Effect::index_header_;
+  const int chunk = Effect::kIndexChunkBytes;
+  int chunks = (h.headers * sizeof(WavHeader) + chunk - 1) / chunk +
+    (h.preload_bytes + chunk - 1) / chunk;
+  check(h.preload_bytes > chunk, "index bigger than a chunk");
+  check(steps == 1 + 5 + 1 + chunks, "index written in chunks");
+
+  // Second time around, the index is read a chunk per step.
+  Effect::BeginScan(font.c_str());
+  steps = 0;
+  for (int opens = LSFS::opens(); Effect::ScanStep(); opens = LSFS::opens()) {
+    check(LSFS::opens() - opens <= 1, "one open");
+    steps++;
+  }
+  check(steps == chunks, "index read in chunks");
+  check(clsh.GetWavHeader(1)->channels == 2, "indexed header");
+  check(clsh.GetWavHeader(2)->preload_bytes > 0, "indexed preload");
+
+  // Switching away while the index is being written doesn't leave a
+  // half written index that looks valid.
+  LSFS::Remove(index.c_str());
+  Effect::BeginScan(font.c_str());
+  for (int i = 0; i < 8; i++) Effect::ScanStep();
+  Effect::BeginScan(font.c_str());
+  steps = 0;
+  while (Effect::ScanStep()) steps++;
+  check(steps == 1 + 5 + 1 + chunks, "cut short index not used");
+  check(blst.GetWavHeader(0)->rate == 22050, "rescanned header");
+  all_effects = nullptr;
+  pass();
+}
+
+void test_prefetch() {
+  std::vector<int16_t> mono = NoiseSamples(2000, 30000, 14);
+  Effect hum("hum"), clsh("clsh", true);
+  std::string fonts[2];
+  for (int i = 0; i < 2; i++) {
+    std::string name = "prefetch" + std::to_string(i);
+    fonts[i] = test_dir() + name;
+    mkdir(fonts[i].c_str(), 0700);
+    WriteWav((name + "/hum.wav").c_str(), 16, 1, 44100, mono);
+    WriteWav((name + "/clsh1.wav").c_str(), 16, 1, 22050 * (i + 1), mono);
+    WriteWav((name + "/clsh2.wav").c_str(), 16, 1, 44100, mono);
+    // Leaves an index behind.
+    strcpy(current_directory, (fonts[i] + "/").c_str());
+    Effect::ScanDirectory(fonts[i].c_str());
+  }
+  uint32_t hits = Effect::prefetch_hits();
+  uint32_t misses = Effect::prefetch_misses();
+
+  int steps = 0;
+  while (Effect::Prefetch(fonts[0].c_str(), fonts[1].c_str())) steps++;
+  check(steps > 4, "prefetch takes a few steps");
+  check(!Effect::Prefetch(fonts[0].c_str(), fonts[1].c_str()), "prefetched");
+
+  for (int i = 0; i < 2; i++) {
+    strcpy(current_directory, (fonts[i] + "/").c_str());
+    Effect::ScanDirectory(fonts[i].c_str());
+    check(clsh.GetWavHeader(0)->rate == 22050u * (i + 1), "prefetched header");
+    check(clsh.GetWavHeader(1)->preload_bytes > 0, "prefetched preload");
+  }
+  check(Effect::prefetch_hits() == hits + 2, "prefetch hits");
+
+  // A changed font doesn't use the stale copy.
+  WriteWav("prefetch0/clsh3.wav", 16, 1, 44100, mono);
+  strcpy(current_directory, (fonts[0] + "/").c_str());
+  Effect::ScanDirectory(fonts[0].c_str());
+  check(clsh.files_found() == 3 && clsh.GetWavHeader(2), "rescanned");
+  check(Effect::prefetch_misses() == misses + 1, "prefetch miss");
+  all_effects = nullptr;
+  pass();
+}
+
+void test_font_index() {
+  std::string font = test_dir() + "indexed/";
+  mkdir(font.c_str(), 0700);
+  mkdir((font + "clsh").c_str(), 0700);
+  std::vector<int16_t> mono = NoiseSamples(2000, 30000, 12);
+  WriteWav("indexed/hum.wav", 16, 1, 44100, mono);
+  WriteWav("indexed/clsh/clsh1.wav", 16, 1, 44100, mono);
+  WriteWav("indexed/clsh/clsh2.wav", 16, 1, 22050, mono);
+  std::string index = font + FONT_INDEX_NAME;
+
+  Effect clsh("clsh", true), hum("hum");
+  strcpy(current_directory, font.c_str());
+  Effect::ScanDirectory(font.c_str());
+  check(LSFS::Exists(index.c_str()), "index written");
+  check(clsh.GetWavHeader(1)->rate == 22050, "headers");
+
+  // Same names and sizes, so the index is used, and the header
+  // isn't read again.
+  WriteWav("indexed/clsh/clsh2.wav", 16, 1, 44100, mono);
+  Effect::ScanDirectory(font.c_str());
+  check(clsh.files_found() == 2 && hum.files_found() == 1, "files");
+  const WavHeader* h = clsh.GetWavHeader(1);
+  check(h && h->rate == 22050 && h->preload_bytes, "indexed headers");
+  check(hum.GetWavHeader(0) && hum.GetWavHeader(0)->data_bytes == 4000,
+        "indexed hum");
+  PlayWav wav;
+  clsh.Select(0);
+  wav.PlayOnce(&clsh);
+  check(ReadToEnd(&wav, 44) == mono, "indexed preload");
+
+  // A new file invalidates it.
+  WriteWav("indexed/clsh/clsh3.wav", 16, 1, 44100, mono);
+  Effect::ScanDirectory(font.c_str());
+  check(clsh.files_found() == 3, "new file");
+  check(clsh.GetWavHeader(1)->rate == 44100, "rescanned");
+  all_effects = nullptr;
+  pass();
+}
+
+void bench_playwav() {
+  std::vector<int16_t> mono = NoiseSamples(AUDIO_RATE * 10, 30000, 5);
+  std::string path = WriteWav("bench.wav", 16, 1, 44100, mono);
+  PlayWav wav;
+  size_t total = 0;
+  double start = now_seconds();
+  for (int i = 0; i < 20; i++) total += ReadAll(&wav, path, 256).size();
+  double t = now_seconds() - start;
+  printf("playwav 16 bit mono 44.1kHz: %.1f Msamples/s\n", total / t / 1e6);
+
+  path = WriteWav("bench48.wav", 16, 1, 48000, mono);
+  total = 0;
+  start = now_seconds();
+  for (int i = 0; i < 2; i++) total += ReadAll(&wav, path, 256).size();
+  t = now_seconds() - start;
+  printf("playwav 16 bit mono 48kHz: %.1f Msamples/s\n", total / t / 1e6);
+}
+
+// Decode cost of IMA ADPCM against the plain 16 bit path it replaces,
+// without the memcpy shortcut that 16 bit mono gets.
+void bench_adpcm() {
+  std::vector<int16_t> stereo = NoiseSamples(AUDIO_RATE * 10, 2000, 5);
+  std::vector<int16_t> decoded;
+  PlayWav wav;
+  const char* names[] = { "16 bit stereo", "IMA ADPCM stereo" };
+  std::string paths[] = {
+    WriteWav("bench_s16.wav", 16, 2, 44100, stereo),
+    WriteAdpcmWav("bench_ima.wav", 2, 2048, stereo, &decoded),
+  };
+  for (int i = 0; i < 2; i++) {
+    size_t total = 0;
+    double start = now_seconds();
+    for (int j = 0; j < 10; j++) total += ReadAll(&wav, paths[i], 256).size();
+    double t = now_seconds() - start;
+    printf("playwav %s: %.1f Msamples/s, %.2f ns/sample\n",
+           names[i], total / t / 1e6, t * 1e9 / total);
+  }
+}
+
+// Hum plus one other sound, with all other slots idle.
+void bench_mixer_idle() {
+  TableStream hum(1), swing(2);
+  SwitchedStream idle[6] = {
+    SwitchedStream(0), SwitchedStream(0), SwitchedStream(0),
+    SwitchedStream(0), SwitchedStream(0), SwitchedStream(0) };
+  AudioDynamicMixer<9> mixer;
+  mixer.streams_[0] = &hum;
+  mixer.streams_[1] = &swing;
+  for (int i = 0; i < 6; i++) mixer.streams_[i + 2] = idle + i;
+  AudioStream::Wake();
+  int16_t out[AUDIO_BUFFER_SIZE];
+  const int blocks = 200000;
+  double start = now_seconds();
+  for (int i = 0; i < blocks; i++) mixer.read(out, NELEM(out));
+  double t = now_seconds() - start;
+  printf("mixer: 2 of 8 streams active: %.1f Msamples/s\n",
+         blocks * NELEM(out) / t / 1e6);
+}
+
+void bench_mixer() {
+  std::vector<TableStream> streams;
+  for (int i = 0; i < 8; i++) streams.push_back(TableStream(i + 1));
+  for (int active = 1; active <= 8; active++) {
+    AudioDynamicMixer<9> mixer;
+    for (int i = 0; i < active; i++) mixer.streams_[i] = &streams[i];
+    AudioStream::Wake();
+    int16_t out[AUDIO_BUFFER_SIZE];
+    const int blocks = 200000;
+    double start = now_seconds();
+    for (int i = 0; i < blocks; i++) mixer.read(out, NELEM(out));
+    double t = now_seconds() - start;
+    printf("mixer: %d streams: %.1f Msamples/s\n",
+           active, blocks * NELEM(out) / t / 1e6);
+  }
+}
+
+int main(int argc, char** argv) {
+  if (argc > 1 && !strcmp(argv[1], "bench")) {
+    bench_mixer();
+    bench_mixer_idle();
+    bench_buffered_mix();
+    bench_volume();
+    bench_crossfade();
+    bench_swing_curve();
+    bench_synth();
+    bench_ring_buffer();
+    bench_playwav();
+    bench_adpcm();
+    bench_effect_scan();
+    return 0;
+  }
+  test_mix_add();
+  test_mixer_steady_state();
+  test_mixer_clamps();
+  test_mixer_active_streams();
+  test_buffered_mix();
+  test_mix_fade_and_stop();
+  test_clear_with_fade();
+  test_volume_ramp();
+  test_crossfade();
+  test_swing_curve();
+  test_synth();
+  test_ring_buffer();
+  test_ring_buffer_threads();
+  test_fill_scheduler();
+  test_histogram();
+  test_buffer_stats();
+  test_playwav_formats();
+  test_resampler();
+  test_adpcm();
+  test_wav_header_cache();
+  test_font_change_reopens();
+  test_swing_pair_switch();
+  test_preload();
+  test_effect_trie();
+  test_font_index();
+  test_fat_dir_entry();
+  test_voice_pool();
+  test_virtual_voice();
+  test_scan_steps();
+  test_prefetch();
+}
@@ -0,0 +1,63 @@
+#ifndef SOUND_VOICE_POOL_H
+#define SOUND_VOICE_POOL_H
+
+// Higher priorities win when there are not enough voices.
+enum VoicePriority {
+  VOICE_LOW,       // swings
+  VOICE_NORMAL,    // clashes, blasts and most other effects
+  VOICE_HIGH,      // hum, lockup
+};
+
+// Hands out wav players without ever waiting for one to finish.
+// When they are all busy, the oldest sound with the lowest priority
+// (but no higher than the one asked for) is cut short. Cutting a
+// sound short fades it out over a few samples at its old volume, see
+// BufferedWavPlayer::CutShort(). Players that someone holds
+// a reference to (hum, lockup, tracks) are never stolen.
+// N is small and fixed, so finding a voice is one bounded pass.
+template<class T, size_t N>
+class VoicePool {
+public:
+  explicit VoicePool(T* players) : players_(players) {}
+
+  RefPtr<T> Get(VoicePriority priority = VOICE_NORMAL) {
+    int best = -1;
+    for (size_t i = 0; i < N; i++) {
+      if (players_[i].refs()) continue;
+      if (!players_[i].isPlaying()) {
+        best = i;
+        break;
+      }
+      if (priority_[i] > priority) continue;
+      if (best == -1 || priority_[i] < priority_[best] ||
+          (priority_[i] == priority_[best] &&
+           (int32_t)(started_[i] - started_[best]) < 0)) {
+        best = i;
+      }
+    }
+    if (best == -1) return RefPtr<T>();
+    if (players_[best].isPlaying()) {
+      STDOUT.print("Stealing wav player ");
+      STDOUT.println(best);
+      steals_++;
+      // Fades out at the old volume, before it's reset below.
+      players_[best].CutShort();
+    }
+    priority_[best] = priority;
+    started_[best] = ++serial_;
+    players_[best].reset_volume();
+    return RefPtr<T>(players_ + best);
+  }
+
+  // Number of sounds cut short to make room for another one.
+  uint32_t steals() const { return steals_; }
+
+private:
+  T* players_;
+  uint8_t priority_[N] = {};
+  uint32_t started_[N] = {};
+  uint32_t serial_ = 0;
+  uint32_t steals_ = 0;
+};
+
+#endif
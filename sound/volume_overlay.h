@@ -18,30 +18,85 @@ public:
   }
   int read(int16_t* data, int elements) override {
     elements = T::read(data, elements);
-    if (volume_.isConstant()) {
+    // While the volume is changing, the gain moves by the same amount
+    // every sample. Once it reaches the target, the rest of the block
+    // has a constant gain.
+    int32_t step;
+    int ramp = volume_.ramp(elements, &step);
+    if (ramp) {
       int32_t mult = volume_.value();
-      if (mult == kMaxVolume) {
-        // Do nothing
-      } else if (mult == 0) {
-        if (stop_when_zero_) {
-          this->Stop();
-          stop_when_zero_ = false;
-        }
-        for (int i = 0; i < elements; i++) data[i] = 0;
-      } else {
-        for (int i = 0; i < elements; i++) {
-          data[i] = clamptoi16((data[i] * mult) >> kVolumeShift);
-        }
+      for (int i = 0; i < ramp; i++) {
+        data[i] = clamptoi16((data[i] * mult) >> kVolumeShift);
+        mult += step;
       }
+      volume_.advance(ramp);
+    }
+    int32_t mult = volume_.value();
+    if (mult == kMaxVolume) {
+      // Do nothing
+    } else if (mult == 0) {
+      StopIfFadedOut();
+      for (int i = ramp; i < elements; i++) data[i] = 0;
     } else {
-      for (int i = 0; i < elements; i++) {
-        int32_t v = (data[i] * (int32_t)volume_.value()) >> kVolumeShift;
-        data[i] = clamptoi16(v);
-        volume_.advance();
+      for (int i = ramp; i < elements; i++) {
+        data[i] = clamptoi16((data[i] * mult) >> kVolumeShift);
       }
     }
     return elements;
   }
+  // Adds |src| multiplied by the volume to |sum|.
+  // Doesn't stop after a FadeAndStop(), since the caller still
+  // holds |src|; call StopIfFadedOut() when done with it.
+  void MixScaled(int32_t* sum, const int16_t* src, int elements) {
+    int32_t step;
+    int ramp = volume_.ramp(elements, &step);
+    if (ramp) {
+      int32_t mult = volume_.value();
+      for (int i = 0; i < ramp; i++) {
+        sum[i] += clamptoi16((src[i] * mult) >> kVolumeShift);
+        mult += step;
+      }
+      volume_.advance(ramp);
+    }
+    int32_t mult = volume_.value();
+    if (mult == kMaxVolume) {
+      MixAdd(sum + ramp, src + ramp, elements - ramp);
+    } else if (mult == 0) {
+      // Silent.
+    } else {
+      MixAddScaled(sum + ramp, src + ramp, elements - ramp, mult, kVolumeShift);
+    }
+  }
+  // Scales and accumulates straight from the buffer in T, without
+  // copying the samples first. T must be a BufferedAudioStream.
+  int MixFromBuffer(int32_t* sum, int elements) {
+    int done = 0;
+    while (done < elements) {
+      const int16_t* data;
+      int n = min(T::peek(&data), elements - done);
+      if (!n) break;
+      int tail = T::faded_tail();
+      if (tail) {
+        // Volume is already applied, see clear_with_fade().
+        n = min(n, tail);
+        MixAdd(sum + done, data, n);
+      } else {
+        MixScaled(sum + done, data, n);
+      }
+      T::consume(n);
+      done += n;
+    }
+    T::UpdateReadStats(elements, done);
+    if (!done) T::RequestFill();
+    StopIfFadedOut();
+    return done;
+  }
+  // Cuts the sound in T short. The faded out tail gets the current
+  // volume, so that it doesn't change if the volume is reset for
+  // the next sound. T must be a BufferedAudioStream.
+  void clear_with_fade() {
+    T::clear_with_fade(volume_.value(), kVolumeShift);
+  }
   float volume() {
     return volume_.value() * (1.0f / (1 << kVolumeShift));
   }
@@ -53,6 +108,7 @@ public:
     volume_.set_target(vol);
   }
   void reset_volume() {
+    stop_when_zero_ = false;
     set_volume_now((int)kDefaultVolume);
     volume_.set_speed(kDefaultSpeed);
   }
@@ -71,12 +127,22 @@ public:
   bool isOff() const {
     return volume_.isConstant() && volume_.value() == 0;
   }
+  bool IsMuted() const override { return isOff(); }
   void FadeAndStop() {
     volume_.set_target(0);
     stop_when_zero_ = true;
   }
+  // True between FadeAndStop() and the stop.
+  bool stopping() const { return stop_when_zero_; }
 
 private:
+  void StopIfFadedOut() {
+    if (stop_when_zero_ && volume_.isConstant()) {
+      this->Stop();
+      stop_when_zero_ = false;
+    }
+  }
+
   volatile bool stop_when_zero_ = false;
   ClickAvoiderLin volume_;
 };
@@ -0,0 +1,111 @@
+#ifndef SOUND_WAV_HEADER_H
+#define SOUND_WAV_HEADER_H
+
+#include "../common/file_reader.h"
+
+// Sample format and location of the sample data in a sound file.
+// Finding these takes several small reads, so Effect does it once
+// per file when the font is scanned, which lets PlayWav seek straight
+// to the samples.
+struct WavHeader {
+  uint32_t data_offset;
+  uint32_t data_bytes;
+  uint32_t rate;
+  uint16_t block_align;
+  uint8_t channels;
+  // 4 means IMA ADPCM, 0 means the file can't be played.
+  uint8_t bits;
+  // The first preload_bytes of sample data, filled in by Effect.
+  uint16_t preload_offset;
+  uint16_t preload_bytes;
+
+  // Smallest amount of sample data that can be decoded.
+  int frame_bytes() const {
+    return bits == 4 ? 4 * channels : channels * bits / 8;
+  }
+};
+
+// Skips chunks until one named |id| is found, and leaves the file
+// at the start of its data.
+bool FindWavChunk(FileReader* file, uint32_t id, uint32_t* len) {
+  uint32_t tmp[2];
+  while (file->Read((uint8_t*)tmp, 8) == 8) {
+    if (tmp[0] == id) {
+      *len = tmp[1];
+      return true;
+    }
+    file->Skip(tmp[1]);
+  }
+  return false;
+}
+
+// Reads the header of a wav file (or a raw file if |wav| is false)
+// and leaves the file at the start of the sample data.
+bool ReadWavHeader(FileReader* file, bool wav, WavHeader* h) {
+  h->bits = 0;
+  h->preload_offset = h->preload_bytes = 0;
+  if (!wav) {
+    h->channels = 1;
+    h->rate = 44100;
+    h->bits = 16;
+    h->block_align = 2;
+    h->data_offset = file->Tell();
+    h->data_bytes = file->FileSize() - h->data_offset;
+    return true;
+  }
+  uint32_t tmp[4];
+  if (file->Read((uint8_t*)tmp, 12) != 12) {
+    STDOUT.println("Failed to read 12 bytes.");
+    return false;
+  }
+  if (tmp[0] != 0x46464952 || tmp[2] != 0x45564157) {
+    STDOUT.println("Not RIFF WAVE.");
+    return false;
+  }
+  uint32_t len;
+  if (!FindWavChunk(file, 0x20746D66, &len)) {  // 'fmt '
+    STDOUT.println("No FMT header.");
+    return false;
+  }
+  if (len < 16) {
+    STDOUT.println("FMT header is wrong size..");
+    return false;
+  }
+  if (file->Read((uint8_t*)tmp, 16) != 16) {
+    STDOUT.println("Read failed.");
+    return false;
+  }
+  if (len > 16) file->Skip(len - 16);
+  h->channels = tmp[0] >> 16;
+  h->rate = tmp[1];
+  h->block_align = tmp[3] & 0xffff;
+  int bits = tmp[3] >> 16;
+  switch (tmp[0] & 0xffff) {
+    case 1:  // PCM
+      if (bits % 8 || bits > 32) bits = 0;
+      break;
+    case 0x11:  // IMA ADPCM
+      if (bits != 4 || h->channels > 2 ||
+          h->block_align <= 4 * h->channels ||
+          h->block_align % (4 * h->channels)) {
+        bits = 0;
+      }
+      break;
+    default:
+      bits = 0;
+  }
+  if (!bits || !h->channels) {
+    STDOUT.println("Wrong format.");
+    return false;
+  }
+  if (!FindWavChunk(file, 0x61746164, &len)) {  // 'data'
+    STDOUT.println("No data.");
+    return false;
+  }
+  h->data_offset = file->Tell();
+  h->data_bytes = len;
+  h->bits = bits;
+  return true;
+}
+
+#endif
@@ -5,17 +5,35 @@ struct WaveForm {
   int16_t table_[1024];
 };
 
+// Phase accumulator oscillator. The top 10 bits of the phase index
+// the 1024-entry table, so it wraps around by itself.
 struct WaveFormSampler {
   WaveFormSampler(const WaveForm& waveform) : waveform_(waveform.table_), pos_(0), delta_(0) {}
   WaveFormSampler(const int16_t* waveform) : waveform_(waveform), pos_(0), delta_(0) {}
   const int16_t *waveform_;
-  int pos_;
-  volatile int delta_;
+  uint32_t pos_;
+  volatile uint32_t delta_;
+
+  // Phase step for |hz| cycles per second.
+  static uint32_t Delta(float hz) {
+    return hz * (4294967296.0f / AUDIO_RATE);
+  }
+
   int16_t next() {
     pos_ += delta_;
-    if (pos_ > 1024 * 65536) pos_ -= 1024 * 65536;
-    // Bilinear lookup here?
-    return waveform_[pos_ >> 16];
+    return waveform_[pos_ >> 22];
+  }
+
+  // Same as calling next() |n| times.
+  void Render(int16_t* out, int n) {
+    uint32_t pos = pos_;
+    uint32_t delta = delta_;
+    const int16_t* waveform = waveform_;
+    for (int i = 0; i < n; i++) {
+      pos += delta;
+      out[i] = waveform[pos >> 22];
+    }
+    pos_ = pos;
   }
 };
 